@@ -149,7 +149,7 @@ void runThread(int ti) {
 	for (int G=1;G<1'000'000;G++){
 		Board board;
 		thread.reset();
-		TT.clear();
+		TT.newGame();
 		moveScoreBuffer.clear();
 
 		for (size_t i=0;i<DATAGEN_RANDOM_MOVES;i++){
@@ -166,7 +166,8 @@ void runThread(int ti) {
 			limit.softnodes = SOFT_NODE_COUNT;
 			limit.maxnodes = HARD_NODE_COUNT;
 			limit.start();
-			thread.nodes = 0;
+			TT.newSearch();
+			thread.resetNodes();
 			thread.bestMove = Move::NO_MOVE;
 			int eval = Search::iterativeDeepening(std::ref(board), std::ref(thread), limit, nullptr);
 			eval = std::min(std::max(-INFINITE, eval), INFINITE);
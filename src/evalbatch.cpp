@@ -0,0 +1,80 @@
+#include "evalbatch.h"
+#include "nnue.h"
+#include "timeman.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+std::vector<std::optional<int>> evaluateBatch(const std::vector<std::string> &fens, int threads){
+	std::vector<std::optional<int>> evals(fens.size());
+	threads = std::clamp<int>(threads, 1, std::max<size_t>(1, fens.size()));
+	const size_t chunk = (fens.size() + threads - 1) / threads;
+
+	auto evaluateSlice = [&](int t){
+		// Heap allocated, the cache holds a full accumulator per perspective
+		std::unique_ptr<RefreshCache> cache = std::make_unique<RefreshCache>();
+		std::unique_ptr<Accumulator> acc = std::make_unique<Accumulator>();
+		Board board;
+		const size_t end = std::min(fens.size(), chunk * (t + 1));
+		for (size_t i=chunk*t;i<end;i++){
+			// Trailing EPD opcodes or data fields, which setFen would otherwise take as the move counters
+			std::string_view fen = fens[i];
+			fen = fen.substr(0, fen.find_first_of("|;"));
+			if (!board.setFen(fen))
+				continue;
+			cache->refresh(network, board, *acc);
+			evals[i] = network.inference(&board, *acc);
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (int t=1;t<threads;t++)
+		workers.emplace_back(evaluateSlice, t);
+	evaluateSlice(0);
+	for (std::thread &w : workers)
+		w.join();
+	return evals;
+}
+
+void evalBatchFile(const std::string &path, int threads){
+	std::ifstream in(path);
+	if (!in){
+		std::cout << "info string Failed to open " << path << std::endl;
+		return;
+	}
+	const std::string outPath = path + ".eval";
+	std::ofstream out(outPath, std::ios::trunc);
+	if (!out){
+		std::cout << "info string Failed to open " << outPath << std::endl;
+		return;
+	}
+
+	TimeLimit timer;
+	timer.start();
+	uint64_t positions = 0;
+	std::vector<std::string> fens;
+	fens.reserve(EVAL_BATCH_SIZE);
+	std::string line;
+	while (true){
+		fens.clear();
+		while (fens.size() < EVAL_BATCH_SIZE && std::getline(in, line))
+			fens.push_back(line);
+		if (fens.empty())
+			break;
+
+		std::string buffer;
+		for (const std::optional<int> &eval : evaluateBatch(fens, threads)){
+			buffer += eval.has_value() ? std::to_string(*eval) : "invalid";
+			buffer += '\n';
+		}
+		out << buffer;
+		positions += fens.size();
+	}
+	out.flush();
+
+	const uint64_t ms = std::max<uint64_t>(1, timer.elapsed());
+	std::cout << "Evaluated " << positions << " positions in " << ms << "ms (" << positions * 1000 / ms << " pos/s) to " << outPath << std::endl;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include "external/chess.hpp"
+#include <optional>
+#include <string>
+#include <vector>
+
+using namespace chess;
+
+// Positions read and evaluated at a time when streaming a file
+constexpr size_t EVAL_BATCH_SIZE = 1 << 16;
+
+// Static evals from the side to move's point of view, in the same order as fens
+// Consecutive positions go to the same thread so its refresh cache only has to apply what changed between them,
+// which is most of the work saved when the input is sorted by game
+std::vector<std::optional<int>> evaluateBatch(const std::vector<std::string> &fens, int threads);
+
+// Evaluates every line of a FEN/EPD file (anything after a '|' or ';' is ignored) and writes one eval
+// per line to <path>.eval, "invalid" for lines that are not a position
+void evalBatchFile(const std::string &path, int threads);
@@ -1460,6 +1460,19 @@ class movegen {
                            int pieces = PieceGenType::PAWN | PieceGenType::KNIGHT | PieceGenType::BISHOP |
                                         PieceGenType::ROOK | PieceGenType::QUEEN | PieceGenType::KING);
 
+    /**
+     * @brief Generates pseudo legal moves, these can leave the king in check. Castling only
+     * needs the rights and an empty path, whether the king passes through check isn't looked at.
+     * @tparam mt
+     * @param movelist
+     * @param board
+     * @param pieces
+     */
+    template <MoveGenType mt = MoveGenType::ALL>
+    void static pseudolegalmoves(Movelist &movelist, const Board &board,
+                                 int pieces = PieceGenType::PAWN | PieceGenType::KNIGHT | PieceGenType::BISHOP |
+                                              PieceGenType::ROOK | PieceGenType::QUEEN | PieceGenType::KING);
+
    private:
     static auto init_squares_between();
     static const std::array<std::array<Bitboard, 64>, 64> SQUARES_BETWEEN_BB;
@@ -1505,6 +1518,9 @@ class movegen {
     template <Color::underlying c, MoveGenType mt>
     static void legalmoves(Movelist &movelist, const Board &board, int pieces);
 
+    template <Color::underlying c, MoveGenType mt>
+    static void pseudolegalmoves(Movelist &movelist, const Board &board, int pieces);
+
     template <Color::underlying c>
     static bool isEpSquareValid(const Board &board, Square ep);
 
@@ -1835,19 +1851,55 @@ class Board {
 
    private:
     struct State {
-        U64 hash;
         CastlingRights castling;
         Square enpassant;
         std::uint8_t half_moves;
         Piece captured_piece;
 
-        State(const U64 &hash, const CastlingRights &castling, const Square &enpassant, const std::uint8_t &half_moves,
+        State() = default;
+        State(const CastlingRights &castling, const Square &enpassant, const std::uint8_t &half_moves,
               const Piece &captured_piece)
-            : hash(hash),
-              castling(castling),
-              enpassant(enpassant),
-              half_moves(half_moves),
-              captured_piece(captured_piece) {}
+            : castling(castling), enpassant(enpassant), half_moves(half_moves), captured_piece(captured_piece) {}
+    };
+
+    /**
+     * @brief The states before the current position. Keys are stored apart from the rest so
+     * repetition checks only read 8 bytes a ply. The storage only grows when it is full, so once
+     * reserve has made room push and pop never allocate. Copies keep the reserved room.
+     */
+    class StateStack {
+       public:
+        void push(U64 key, const State &state) {
+            if (size_ == keys_.size()) reserve(std::max<std::size_t>(size_, 256));
+
+            keys_[size_]   = key;
+            states_[size_] = state;
+            size_++;
+        }
+
+        void pop() noexcept { size_--; }
+        void clear() noexcept { size_ = 0; }
+
+        /**
+         * @brief Make sure n more states fit without allocating.
+         * @param n
+         */
+        void reserve(std::size_t n) {
+            if (size_ + n <= keys_.size()) return;
+            keys_.resize(size_ + n);
+            states_.resize(size_ + n);
+        }
+
+        [[nodiscard]] const State &back() const noexcept { return states_[size_ - 1]; }
+        [[nodiscard]] U64 backKey() const noexcept { return keys_[size_ - 1]; }
+        [[nodiscard]] U64 key(std::size_t i) const noexcept { return keys_[i]; }
+        [[nodiscard]] std::size_t size() const noexcept { return size_; }
+        [[nodiscard]] std::size_t capacity() const noexcept { return keys_.size(); }
+
+       private:
+        std::vector<U64> keys_;
+        std::vector<State> states_;
+        std::size_t size_ = 0;
     };
 
     enum class PrivateCtor { CREATE };
@@ -2028,7 +2080,7 @@ class Board {
         // Validate side to move
         assert((at(move.from()) < Piece::BLACKPAWN) == (stm_ == Color::WHITE));
 
-        prev_states_.emplace_back(key_, cr_, ep_sq_, hfm_, captured);
+        prev_states_.push(key_, State(cr_, ep_sq_, hfm_, captured));
 
         hfm_++;
         plies_++;
@@ -2240,15 +2292,15 @@ class Board {
             }
         }
 
-        key_ = prev.hash;
-        prev_states_.pop_back();
+        key_ = prev_states_.backKey();
+        prev_states_.pop();
     }
 
     /**
      * @brief Make a null move. (Switches the side to move)
      */
     void makeNullMove() {
-        prev_states_.emplace_back(key_, cr_, ep_sq_, hfm_, Piece::NONE);
+        prev_states_.push(key_, State(cr_, ep_sq_, hfm_, Piece::NONE));
 
         key_ ^= Zobrist::sideToMove();
         if (ep_sq_ != Square::NO_SQ) key_ ^= Zobrist::enpassant(ep_sq_.file());
@@ -2268,13 +2320,13 @@ class Board {
         ep_sq_ = prev.enpassant;
         cr_    = prev.castling;
         hfm_   = prev.half_moves;
-        key_   = prev.hash;
+        key_   = prev_states_.backKey();
 
         plies_--;
 
         stm_ = ~stm_;
 
-        prev_states_.pop_back();
+        prev_states_.pop();
     }
 
     /**
@@ -2367,6 +2419,29 @@ class Board {
      * @return
      */
     [[nodiscard]] U64 hash() const noexcept { return key_; }
+
+    /**
+     * @brief Cheap estimate of the hash key after making the move. Castling rights and a newly
+     * set en passant square are ignored, so it is not the real key of the position. Fine for
+     * prefetching, and for ABDADA's busy table as long as marking and checking both use it:
+     * the same move from the same position always gives the same estimate, and two children
+     * that only differ in castling or en passant sharing a mark just defers a move needlessly.
+     * @param move
+     * @return
+     */
+    [[nodiscard]] U64 hashAfter(const Move move) const noexcept {
+        const auto piece    = at(move.from());
+        const auto captured = at(move.to());
+        U64 key             = key_ ^ Zobrist::sideToMove() ^ Zobrist::piece(piece, move.from());
+
+        if (ep_sq_ != Square::NO_SQ) key ^= Zobrist::enpassant(ep_sq_.file());
+        if (move.typeOf() == Move::CASTLING) return key;
+        if (captured != Piece::NONE) key ^= Zobrist::piece(captured, move.to());
+
+        if (move.typeOf() == Move::PROMOTION)
+            return key ^ Zobrist::piece(Piece(move.promotionType(), stm_), move.to());
+        return key ^ Zobrist::piece(piece, move.to());
+    }
     [[nodiscard]] Color sideToMove() const noexcept { return stm_; }
     [[nodiscard]] Square enpassantSq() const noexcept { return ep_sq_; }
     [[nodiscard]] CastlingRights castlingRights() const noexcept { return cr_; }
@@ -2429,13 +2504,19 @@ class Board {
         const auto size = static_cast<int>(prev_states_.size());
 
         for (int i = size - 2; i >= 0 && i >= size - hfm_ - 1; i -= 2) {
-            if (prev_states_[i].hash == key_) c++;
+            if (prev_states_.key(i) == key_) c++;
             if (c == count) return true;
         }
 
         return false;
     }
 
+    /**
+     * @brief Makes room for plies more moves in the history, so making them never allocates.
+     * @param plies
+     */
+    void reserveHistory(std::size_t plies) { prev_states_.reserve(plies); }
+
     /**
      * @brief Checks if the current position is a draw by 50 move rule.
      * Keep in mind that by the rules of chess, if the position has 50 half
@@ -2880,7 +2961,7 @@ class Board {
 
     virtual void removePiece(Piece piece, Square sq) { removePieceInternal(piece, sq); }
 
-    std::vector<State> prev_states_;
+    StateStack prev_states_;
 
     std::array<Bitboard, 6> pieces_bb_ = {};
     std::array<Bitboard, 2> occ_bb_    = {};
@@ -3876,6 +3957,73 @@ inline void movegen::legalmoves(Movelist &movelist, const Board &board, int piec
         legalmoves<Color::BLACK, mt>(movelist, board, pieces);
 }
 
+template <Color::underlying c, movegen::MoveGenType mt>
+inline void movegen::pseudolegalmoves(Movelist &movelist, const Board &board, int pieces) {
+    // Same as legalmoves with empty pin masks and a full checkmask
+    auto king_sq = board.kingSq(c);
+
+    Bitboard occ_us  = board.us(c);
+    Bitboard occ_opp = board.us(~c);
+    Bitboard occ_all = occ_us | occ_opp;
+
+    Bitboard movable_square;
+
+    if constexpr (mt == MoveGenType::ALL)
+        movable_square = ~occ_us;
+    else if constexpr (mt == MoveGenType::CAPTURE)
+        movable_square = occ_opp;
+    else  // QUIET moves
+        movable_square = ~occ_all;
+
+    if (pieces & PieceGenType::KING) {
+        whileBitboardAdd(movelist, Bitboard::fromSquare(king_sq),
+                         [&](Square sq) { return generateKingMoves(sq, 0ull, movable_square); });
+
+        if (mt != MoveGenType::CAPTURE) {
+            Bitboard moves_bb = generateCastleMoves<c>(board, king_sq, 0ull, 0ull);
+
+            while (moves_bb) {
+                Square to = moves_bb.pop();
+                movelist.add(Move::make<Move::CASTLING>(king_sq, to));
+            }
+        }
+    }
+
+    if (pieces & PieceGenType::PAWN) {
+        generatePawnMoves<c, mt>(board, movelist, 0ull, 0ull, ~0ull, occ_opp);
+    }
+
+    if (pieces & PieceGenType::KNIGHT) {
+        whileBitboardAdd(movelist, board.pieces(PieceType::KNIGHT, c),
+                         [&](Square sq) { return generateKnightMoves(sq) & movable_square; });
+    }
+
+    if (pieces & PieceGenType::BISHOP) {
+        whileBitboardAdd(movelist, board.pieces(PieceType::BISHOP, c),
+                         [&](Square sq) { return generateBishopMoves(sq, 0ull, occ_all) & movable_square; });
+    }
+
+    if (pieces & PieceGenType::ROOK) {
+        whileBitboardAdd(movelist, board.pieces(PieceType::ROOK, c),
+                         [&](Square sq) { return generateRookMoves(sq, 0ull, occ_all) & movable_square; });
+    }
+
+    if (pieces & PieceGenType::QUEEN) {
+        whileBitboardAdd(movelist, board.pieces(PieceType::QUEEN, c),
+                         [&](Square sq) { return generateQueenMoves(sq, 0ull, 0ull, occ_all) & movable_square; });
+    }
+}
+
+template <movegen::MoveGenType mt>
+inline void movegen::pseudolegalmoves(Movelist &movelist, const Board &board, int pieces) {
+    movelist.clear();
+
+    if (board.sideToMove() == Color::WHITE)
+        pseudolegalmoves<Color::WHITE, mt>(movelist, board, pieces);
+    else
+        pseudolegalmoves<Color::BLACK, mt>(movelist, board, pieces);
+}
+
 template <Color::underlying c>
 inline bool movegen::isEpSquareValid(const Board &board, Square ep) {
     const auto stm = board.sideToMove();
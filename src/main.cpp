@@ -3,6 +3,8 @@
 #include <iostream>
 #include <fstream>
 #include <filesystem>
+#include <sstream>
+#include <iomanip>
 #include "external/chess.hpp"
 #include "search.h"
 #include "searcher.h"
@@ -11,7 +13,9 @@
 #include "uci.h"
 #include "timeman.h"
 #include "datagen.h"
+#include "evalbatch.h"
 #include "util.h"
+#include "numa.h"
 
 using namespace chess;
 using namespace std::chrono;
@@ -40,6 +44,7 @@ INCBIN(EVAL, EVALFILE);
 
 
 NNUE network;
+SmallNNUE smallNetwork;
 
 // Thanks Weiss
 void ParseTimeControl(char *str, Color color, Search::Limit &limit) {
@@ -109,23 +114,128 @@ void UCIPosition(Board &board, char *str) {
 
 }
 
-static int HashInput(char *str) {
-    int hash = 0;
-    int len = 1;
-    while (*str && *str != ' ')
-        hash ^= *(str++) ^ len++;
-    return hash;
-};
+// Set when the small net came from SmallNetFile rather than being built from the main net
+bool smallNetFromFile = false;
+// Checksum of the main net a built small net came from, so it is only rebuilt once it's wanted again
+uint64_t smallNetSource = 0;
+
+// Loads the small net from a file, or with no file builds one out of the main net
+void UCISmallNetFile(const char *path){
+    if (path == nullptr || strcmp(path, "<empty>") == 0){
+        smallNetwork.shrink(network, Search::benchFens);
+        smallNetFromFile = false;
+        smallNetSource = network.checksum();
+        std::cout << "info string Small net built from the main net" << std::endl;
+        return;
+    }
+    std::string error;
+    if (smallNetwork.load(path, error)){
+        smallNetFromFile = true;
+        std::cout << "info string Using small net " << path << std::endl;
+    }
+    else
+        std::cout << "info string Failed to load small net " << path << ": " << error << std::endl;
+}
+
+void UCIEvalFile(Searcher &searcher, const char *path){
+    std::string error;
+    bool loaded;
+    std::string name;
+    if (path == nullptr || strcmp(path, "<empty>") == 0){
+        name = "embedded net";
+        #if defined(_MSC_VER) && !defined(__clang__)
+            loaded = network.load(EVALFILE, error);
+        #else
+            loaded = network.loadEmbedded(gEVALData, gEVALSize, error);
+        #endif
+    }
+    else {
+        name = path;
+        loaded = network.load(path, error);
+    }
+    if (loaded){
+        // Cached evals are from the old net
+        searcher.TT.evals.clear();
+        std::cout << "info string Using " << name << std::endl;
+        // Building one takes a while, with SmallNet off that waits until it's turned on
+        if (Search::useSmallNet && !smallNetFromFile)
+            UCISmallNetFile(nullptr);
+    }
+    else
+        std::cout << "info string Failed to load " << name << ": " << error << std::endl;
+}
 
 void UCISetOption(Searcher &searcher, char *str) {
 
+    // Backs the transposition table with a file, e.g. on /dev/shm to share it between processes
+    // Checked before Hash since option names are matched by prefix
+    if (OptionName(str, "HashFile")) {
+        char *path = OptionValue(str);
+        if (path != nullptr && strcmp(path, "<empty>") != 0)
+            searcher.mapTT(path);
+        else if (searcher.TT.fileBacked())
+            searcher.resizeTT(std::max<uint64_t>(1, searcher.TT.size * sizeof(TTBucket) / (1024 * 1024)));
     // Sets the size of the transposition table
-    if (OptionName(str, "Hash")) {
-        searcher.TT.resize((uint64_t)atoi(OptionValue(str)));
-        std::cout << "Hash Table successfully resized" << std::endl;
+    } else if (OptionName(str, "Hash")) {
+        const uint64_t MB = (uint64_t)atoi(OptionValue(str));
+        // Resizing would swap the mapped table for a private one, and the file can be shared so it isn't regrown either
+        if (searcher.TT.fileBacked()){
+            if (MB != searcher.TT.size * sizeof(TTBucket) / (1024 * 1024))
+                std::cout << "info string Hash stays at the size of " << searcher.TT.mappedFile() << ", set HashFile to <empty> first to resize" << std::endl;
+        }
+        else {
+            if (searcher.resizeTT(MB))
+                std::cout << "Hash Table successfully resized" << std::endl;
+        }
+    // Zeroes the whole table, ucinewgame only ages it out
+    } else if (OptionName(str, "Clear Hash")) {
+        searcher.clearTT();
     // Sets number of threads to use for searching
     } else if (OptionName(str, "Threads")) {
         searcher.initialize(atoi(OptionValue(str)));
+    // Swaps the net without restarting, <empty> goes back to the embedded one
+    } else if (OptionName(str, "EvalFile")) {
+        UCIEvalFile(searcher, OptionValue(str));
+    // Checked before SmallNet since option names are matched by prefix
+    } else if (OptionName(str, "SmallNetFile")) {
+        char *path = OptionValue(str);
+        // Going back to a built net, which is left for SmallNet to make if it's off
+        if (path == nullptr || strcmp(path, "<empty>") == 0){
+            smallNetFromFile = false;
+            smallNetSource = 0;
+            if (Search::useSmallNet)
+                UCISmallNetFile(nullptr);
+        }
+        else
+            UCISmallNetFile(path);
+    // Qsearch stands pat on a much smaller net's eval when it is far outside the window
+    } else if (OptionName(str, "SmallNet")) {
+        char *value = OptionValue(str);
+        Search::useSmallNet = value != nullptr && strcmp(value, "true") == 0;
+        const bool stale = smallNetwork.weights == nullptr || (!smallNetFromFile && smallNetSource != network.checksum());
+        if (Search::useSmallNet && stale)
+            UCISmallNetFile(nullptr);
+    // Evaluates the output layer in int8, see quantcheck for how far it is from int16
+    } else if (OptionName(str, "Int8Output")) {
+        char *value = OptionValue(str);
+        network.int8Output = value != nullptr && strcmp(value, "true") == 0;
+        searcher.TT.evals.clear();
+    // Size of the eval cache shared by all threads
+    } else if (OptionName(str, "EvalCache")) {
+        searcher.TT.evals.resize(std::max(1, atoi(OptionValue(str))));
+    // Pins search threads to NUMA nodes, the threads have to rebuild their ThreadInfo on their new node
+    } else if (OptionName(str, "NumaPin")) {
+        char *value = OptionValue(str);
+        searcher.numaPin = value != nullptr && strcmp(value, "true") == 0;
+        searcher.initialize(searcher.threadCount());
+    // Copies the net to every NUMA node, done at the next go
+    } else if (OptionName(str, "NumaReplicate")) {
+        char *value = OptionValue(str);
+        searcher.numaReplicate = value != nullptr && strcmp(value, "true") == 0;
+    // Lazy SMP staggers the threads' depths, ABDADA defers moves another thread is already on
+    } else if (OptionName(str, "ParallelMode")) {
+        char *value = OptionValue(str);
+        searcher.parallelMode = value != nullptr && strcmp(value, "ABDADA") == 0 ? Search::ParallelMode::ABDADA : Search::ParallelMode::LAZY_SMP;
     }
 }
 void UCIInfo(){
@@ -133,15 +243,297 @@ void UCIInfo(){
     std::cout << "id author Anik Patel\n";
     std::cout << "option name Hash type spin default 16 min 2 max 65536\n";
     std::cout << "option name Threads type spin default 1 min 1 max 256\n";
+    std::cout << "option name Clear Hash type button\n";
+    std::cout << "option name HashFile type string default <empty>\n";
+    std::cout << "option name Int8Output type check default false\n";
+    std::cout << "option name SmallNet type check default false\n";
+    std::cout << "option name SmallNetFile type string default <empty>\n";
+    std::cout << "option name EvalFile type string default <empty>\n";
+    std::cout << "option name EvalCache type spin default 8 min 1 max 1024\n";
+    std::cout << "option name NumaPin type check default true\n";
+    std::cout << "option name NumaReplicate type check default false\n";
+    std::cout << "option name ParallelMode type combo default LazySMP var LazySMP var ABDADA\n";
+    std::cout << "info string NNUE kernels " << NNUE::kernelName() << "\n";
+    std::cout << "info string NUMA nodes " << Numa::nodeCount() << "\n";
     std::cout << "uciok" << std::endl; 
 }
 
 void UCIEvaluate(Board &board){
+    static RefreshCache cache;
     Accumulator a;
-    a.refresh(board);
+    cache.refresh(network, board, a);
     std::cout << network.inference(&board, a) << std::endl;
 }
 
+// Compares the int8 output layer against the int16 one on every position a couple plies from the bench positions
+void UCIQuantCheck(){
+    std::unique_ptr<AccumulatorStack> accs = std::make_unique<AccumulatorStack>();
+    const bool int8Output = network.int8Output;
+    uint64_t positions = 0, exact = 0, totalError = 0;
+    int maxError = 0;
+    const auto compare = [&](Board &board){
+        Accumulator &a = accs->current();
+        network.int8Output = false;
+        const int int16Eval = network.inference(&board, a);
+        network.int8Output = true;
+        const int error = std::abs(network.inference(&board, a) - int16Eval);
+        positions++;
+        exact += error == 0;
+        totalError += error;
+        maxError = std::max(maxError, error);
+    };
+    for (const std::string &fen : Search::benchFens){
+        Board board(fen);
+        accs->reset(network, board);
+        compare(board);
+        Movelist moves;
+        movegen::legalmoves(moves, board);
+        for (Move m : moves){
+            MakeMove(board, *accs, m);
+            compare(board);
+            Movelist replies;
+            movegen::legalmoves(replies, board);
+            for (Move r : replies){
+                MakeMove(board, *accs, r);
+                compare(board);
+                UnmakeMove(board, *accs, r);
+            }
+            UnmakeMove(board, *accs, m);
+        }
+    }
+    network.int8Output = int8Output;
+    std::cout << "Positions: " << positions << " Exact: " << 100.0 * exact / positions << "%"
+              << " Mean error: " << (double)totalError / positions << "cp Max error: " << maxError << "cp" << std::endl;
+}
+
+// Evaluates every position up to two plies from the bench positions with one architecture
+// Accumulators are updated incrementally, like search does
+template<typename Arch>
+void NetBench(const char *name, const BasicNNUE<Arch> &net){
+    using Stack = BasicAccumulatorStack<Arch>;
+    std::unique_ptr<Stack> accs = std::make_unique<Stack>();
+    const auto push = [&](Board &board, Move &m){
+        DirtyFeatures(board, m, accs->push());
+        board.makeMove(m);
+    };
+    const auto pop = [&](Board &board, Move &m){
+        board.unmakeMove(m);
+        accs->pop();
+    };
+    const auto walk = [&](auto &&evaluate){
+        for (const std::string &fen : Search::benchFens){
+            Board board(fen);
+            accs->reset(net, board);
+            evaluate(board);
+            Movelist moves;
+            movegen::legalmoves(moves, board);
+            for (Move m : moves){
+                push(board, m);
+                evaluate(board);
+                Movelist replies;
+                movegen::legalmoves(replies, board);
+                for (Move r : replies){
+                    push(board, r);
+                    evaluate(board);
+                    pop(board, r);
+                }
+                pop(board, m);
+            }
+        }
+    };
+
+    uint64_t positions = 0;
+    int64_t evalSum = 0;
+    TimeLimit timer;
+    timer.start();
+    walk([&](Board &board){
+        evalSum += net.inference(&board, *accs);
+        positions++;
+    });
+    const uint64_t ms = std::max<uint64_t>(1, timer.elapsed());
+    std::cout << name << " hidden " << Arch::HIDDEN << ": " << positions << " positions in " << ms << "ms ("
+              << positions * 1000 / ms << " pos/s) mean eval " << evalSum / (int64_t)positions;
+
+    // Untimed second pass checking the sparse kernels against the dense scalar L1
+    if constexpr (Arch::DEEP){
+        uint64_t mismatches = 0;
+        walk([&](Board &board){
+            mismatches += net.inference(&board, *accs) != net.referenceInference(&board, accs->current());
+        });
+        std::cout << " reference mismatches " << mismatches;
+    }
+    std::cout << std::endl;
+}
+
+// Compares the eval speed of every compiled architecture
+// Only the main one has a real net, the others get random weights which is fine for timing
+void UCINetBench(){
+    NetBench("main", network);
+    std::unique_ptr<BasicNNUE<WideArch>> wide = std::make_unique<BasicNNUE<WideArch>>();
+    wide->randomize();
+    NetBench("wide", *wide);
+    std::unique_ptr<BasicNNUE<DeepArch>> deep = std::make_unique<BasicNNUE<DeepArch>>();
+    deep->randomize();
+    NetBench("deep", *deep);
+}
+
+// evalbatch <file> [threads]
+void UCIEvalBatch(char *str){
+    std::istringstream args(str + 9);
+    std::string path;
+    int threads = 1;
+    args >> path >> threads;
+    if (path.empty()){
+        std::cout << "info string Usage: evalbatch <file> [threads]" << std::endl;
+        return;
+    }
+    evalBatchFile(path, std::max(1, threads));
+}
+
+void UCIExportNet(const char *path){
+    if (network.save(path))
+        std::cout << "info string Net written to " << path << std::endl;
+    else
+        std::cout << "info string Failed to write net to " << path << std::endl;
+}
+
+// perft <depth> [check]
+// With check every node's incrementally updated accumulator is compared against a full refresh, which is much slower
+void UCIPerft(Board &board, char *str){
+    int depth = std::max(0, atoi(str + 6));
+    const bool check = strstr(str + 6, "check") != nullptr;
+    std::unique_ptr<AccumulatorStack> accs = std::make_unique<AccumulatorStack>();
+    accs->reset(network, board);
+    uint64_t mismatches = 0;
+    TimeLimit timer;
+    timer.start();
+    uint64_t nodes = perft(board, *accs, depth, check, mismatches);
+    std::cout << "Nodes: " << nodes << " Time: " << timer.elapsed() << "ms" << std::endl;
+    if (check)
+        std::cout << "Accumulator mismatches: " << mismatches << std::endl;
+    else
+        std::cout << "Accumulator mismatches: not checked, use perft " << depth << " check" << std::endl;
+}
+
+// smpbench [depth]
+// Time to depth and nodes over the bench positions with one thread, then with Threads threads in each ParallelMode
+// Every search starts from a cleared table and histories
+void UCISmpBench(Searcher &searcher, char *str){
+    int depth = atoi(str + 9);
+    if (depth <= 0)
+        depth = BENCH_DEPTH;
+    const int threads = searcher.threadCount();
+    const Search::ParallelMode mode = searcher.parallelMode;
+    searcher.stop();
+
+    struct Result {
+        uint64_t ms = 0;
+        uint64_t nodes = 0;
+    };
+    const auto run = [&]{
+        Result result;
+        // Keep the searches' own output out of the way
+        std::streambuf *out = std::cout.rdbuf(nullptr);
+        for (const std::string &fen : Search::benchFens){
+            Board board(fen);
+            searcher.reset();
+            searcher.clearTT();
+            Search::Limit limit = Search::Limit();
+            limit.depth = depth;
+            limit.start();
+            TimeLimit timer;
+            timer.start();
+            searcher.start(board, limit);
+            searcher.mainThread->wait();
+            searcher.waitForWorkers();
+            result.ms += timer.elapsed();
+            result.nodes += searcher.nodeCount();
+        }
+        std::cout.rdbuf(out);
+        return result;
+    };
+
+    searcher.initialize(1);
+    const Result single = run();
+    searcher.initialize(threads);
+    std::cout << "Depth " << depth << " over " << Search::benchFens.size() << " positions" << std::endl;
+    std::cout << "1 thread: " << single.ms << "ms " << single.nodes << " nodes" << std::endl;
+    for (Search::ParallelMode m : {Search::ParallelMode::LAZY_SMP, Search::ParallelMode::ABDADA}){
+        searcher.parallelMode = m;
+        const Result r = run();
+        std::cout << (m == Search::ParallelMode::ABDADA ? "ABDADA " : "LazySMP ") << threads << " threads: "
+                  << r.ms << "ms " << r.nodes << " nodes, time to depth " << std::fixed << std::setprecision(2)
+                  << (double)single.ms / std::max<uint64_t>(1, r.ms) << "x faster, " << (double)r.nodes / std::max<uint64_t>(1, single.nodes)
+                  << "x the nodes" << std::defaultfloat << std::endl;
+    }
+    searcher.parallelMode = mode;
+}
+
+// ttstress [threads] [seconds]
+// Threads store and probe the same few thousand keys, crammed into a few buckets, as fast as they can
+// Every key has its own low 16 bits and data made from them, so a hit whose data doesn't match its key is a torn entry
+void UCITTStress(char *str){
+    std::istringstream args(str + 8);
+    int threads = 4, seconds = 5;
+    args >> threads >> seconds;
+    threads = std::max(1, threads);
+    seconds = std::max(1, seconds);
+
+    // The top bits pick the bucket, so they all land in 16 buckets and different keys keep writing over the same slots
+    constexpr int KEYS = 4096;
+    std::array<uint64_t, KEYS> keys;
+    for (int i=0;i<KEYS;i++)
+        keys[i] = static_cast<uint64_t>(i % 16) << 60 | i;
+    const auto expected = [](uint16_t key16){
+        TTEntry e{};
+        e.key16 = key16;
+        e.move = static_cast<uint16_t>(key16 * 7 + 1);
+        e.score = static_cast<int16_t>(key16 % 4000 - 2000);
+        e.staticEval = static_cast<int16_t>(key16 % 3000 - 1500);
+        e.depth = static_cast<uint8_t>(key16 % 64);
+        return e;
+    };
+
+    TTable TT(1);
+    std::atomic<bool> done(false);
+    std::atomic<uint64_t> stores(0), probes(0), hits(0), torn(0);
+    std::vector<std::thread> workers;
+    for (int t=0;t<threads;t++){
+        workers.emplace_back([&, t]{
+            std::mt19937 pick(t + 1);
+            uint64_t s = 0, p = 0, h = 0, bad = 0;
+            while (!done.load(std::memory_order_relaxed)){
+                for (int i=0;i<1024;i++){
+                    const uint64_t key = keys[pick() % KEYS];
+                    if (pick() & 1){
+                        const TTEntry e = expected(static_cast<uint16_t>(key));
+                        TT.store(key, Move(e.move), e.score, e.staticEval, TTFlag::EXACT, e.depth);
+                        s++;
+                        continue;
+                    }
+                    TTEntry found;
+                    p++;
+                    if (!TT.probe(key, found))
+                        continue;
+                    h++;
+                    const TTEntry e = expected(found.key16);
+                    bad += found.move != e.move || found.score != e.score || found.staticEval != e.staticEval || found.depth != e.depth;
+                }
+            }
+            stores += s;
+            probes += p;
+            hits += h;
+            torn += bad;
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    done = true;
+    for (std::thread &w : workers)
+        w.join();
+    std::cout << "Threads: " << threads << " Stores: " << stores << " Probes: " << probes << " Hits: " << hits
+              << " Torn: " << torn << (torn == 0 ? " (ok)" : " (FAILED)") << std::endl;
+}
+
 void UCIGo(Searcher &searcher, Board &board, char *str){
     searcher.stop();
 
@@ -168,13 +560,15 @@ int main(int agrc, char *argv[]){
     initLookups();
 	Board board = Board();
     //network.randomize();
+    std::string netError;
     #if defined(_MSC_VER) && !defined(__clang__)
-        network.loadNetwork(EVALFILE);
+        if (!network.load(EVALFILE, netError))
+            std::cerr << "Failed to load " << EVALFILE << ": " << netError << std::endl;
         std::cerr << "WARNING: This file was compiled with MSVC, this means that an nnue was NOT embedded into the exe." << std::endl;
     #else
-            network = *reinterpret_cast<const NNUE*>(gEVALData);
+        if (!network.loadEmbedded(gEVALData, gEVALSize, netError))
+            std::cerr << "Embedded net is unusable: " << netError << std::endl;
     #endif
-    
 
     Search::fillLmr();
     Searcher searcher = Searcher();
@@ -189,7 +583,7 @@ int main(int agrc, char *argv[]){
     }
     char str[INPUT_SIZE];
     while (GetInput(str)) {
-        switch (HashInput(str)) {
+        switch (ParseCommand(str)) {
             case GO         : UCIGo(searcher, board, str);                break;
             case UCI        : UCIInfo();                                  break;
             case ISREADY    : std::cout << "readyok" << std::endl;        break;
@@ -203,10 +597,21 @@ int main(int agrc, char *argv[]){
             case PRINT      : std::cout << board << std::endl;            break;
             case EVAL       : UCIEvaluate(board);                         break;
             case BENCH      : Search::bench();                            break;
+            case EVALBATCH  : UCIEvalBatch(str);                          break;
             case DATAGEN    : BeginDatagen(str);                          break;
+            case SAVEHASH   : searcher.saveTT(str + 9);                   break;
+            case PERFT      : UCIPerft(board, str);                       break;
+            case QUANTCHECK : UCIQuantCheck();                            break;
+            case EXPORTNET  : UCIExportNet(str + 10);                     break;
+            case NETBENCH   : UCINetBench();                              break;
+            case SMPBENCH   : UCISmpBench(searcher, str);                 break;
+            case TTSTRESS   : UCITTStress(str);                           break;
+            case UNKNOWN    :                                             break;
 
         }
     }
+    // Input closed, the pooled threads are only joined once they're parked
+    searcher.stop();
 
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,153 @@
+#pragma once
+
+#include "external/chess.hpp"
+#include "search.h"
+#include "util.h"
+#include "parameters.h"
+
+#include <algorithm>
+
+using namespace chess;
+
+namespace Search {
+
+enum class PickStage : uint8_t {
+	TT_MOVE,
+	GEN_CAPTURES,
+	GOOD_CAPTURES,
+	KILLER,
+	GEN_QUIETS,
+	QUIETS,
+	BAD_CAPTURES,
+	DONE
+};
+
+// Whether move is one of the board's pseudo legal moves, generating every move of the moving piece's type and looking for it
+// Used for the TT move and killer, which can come from a different position
+inline bool isPseudoLegal(Board &board, Move move){
+	if (moveIsNull(move))
+		return false;
+	const Piece piece = board.at(move.from());
+	if (piece == Piece::NONE || piece.color() != board.sideToMove())
+		return false;
+	Movelist moves;
+	movegen::pseudolegalmoves(moves, board, 1 << (int)piece.type());
+	return std::find(moves.begin(), moves.end(), move) != moves.end();
+}
+
+// Captures as movegen splits them, en passant is one and castling (king takes rook) isn't
+inline bool isCapture(Board &board, Move move){
+	return move.typeOf() == Move::ENPASSANT || (move.typeOf() != Move::CASTLING && board.at(move.to()) != Piece::NONE);
+}
+
+// Hands out moves best first, generating and scoring each kind only once the search gets to it
+// A node that cuts off on the TT move generates nothing, one that cuts off on a capture never sees the quiets
+// Order is TT move, captures that pass SEE by capthist + MVV, killer, quiets by history, the remaining captures
+// Moves are only pseudo legal, the search checks isLegal right before making one
+struct MovePicker {
+	ThreadInfo &thread;
+	Stack *ss;
+	Move ttMove;
+	Move killer;
+	// Qsearch, only captures and no SEE split since it prunes on SEE itself
+	bool capturesOnly;
+	PickStage stage;
+	Movelist moves;
+	Movelist badCaptures;
+	int idx;
+	// Pins and checkers, only worked out once a move needs checking
+	// Qsearch nodes with no captures, or only ones SEE pruning drops, never pay for them
+	StateInfo legality;
+	bool legalityReady;
+
+	MovePicker(ThreadInfo &thread, Stack *ss, Move ttMove, bool capturesOnly) : thread(thread), ss(ss), ttMove(ttMove), capturesOnly(capturesOnly) {
+		killer = capturesOnly ? Move::NO_MOVE : ss->killer;
+		stage = PickStage::TT_MOVE;
+		idx = 0;
+		legalityReady = false;
+	}
+
+	bool isLegal(Move move){
+		if (!legalityReady){
+			legalityInfo(thread.board, &legality);
+			legalityReady = true;
+		}
+		return ::isLegal(thread.board, move, legality);
+	}
+
+	// Selection sort, one step at a time
+	Move pickBest(){
+		for (int i=idx+1;i<moves.size();i++)
+			if (moves[i].score() > moves[idx].score())
+				std::swap(moves[idx], moves[i]);
+		return moves[idx++];
+	}
+
+	// Move::NO_MOVE once there are none left
+	Move next(){
+		Board &board = thread.board;
+		switch (stage){
+			case PickStage::TT_MOVE:
+				stage = PickStage::GEN_CAPTURES;
+				if (isPseudoLegal(board, ttMove) && (!capturesOnly || isCapture(board, ttMove)))
+					return ttMove;
+				[[fallthrough]];
+			case PickStage::GEN_CAPTURES:
+				movegen::pseudolegalmoves<movegen::MoveGenType::CAPTURE>(moves, board);
+				for (Move &move : moves){
+					const PieceType victim = move.typeOf() == Move::ENPASSANT ? PieceType::PAWN : board.at<PieceType>(move.to());
+					move.setScore(thread.getCapthist(board, move) + MVV_VALUES[(int)victim]);
+				}
+				idx = 0;
+				stage = PickStage::GOOD_CAPTURES;
+				[[fallthrough]];
+			case PickStage::GOOD_CAPTURES:
+				while (idx < moves.size()){
+					Move move = pickBest();
+					if (move == ttMove)
+						continue;
+					if (capturesOnly || SEE(board, move, SEE_ORDERING_MARGIN))
+						return move;
+					badCaptures.add(move);
+				}
+				if (capturesOnly){
+					stage = PickStage::DONE;
+					return Move::NO_MOVE;
+				}
+				stage = PickStage::KILLER;
+				[[fallthrough]];
+			case PickStage::KILLER:
+				stage = PickStage::GEN_QUIETS;
+				if (killer != ttMove && !isCapture(board, killer) && isPseudoLegal(board, killer))
+					return killer;
+				[[fallthrough]];
+			case PickStage::GEN_QUIETS:
+				moves.clear();
+				movegen::pseudolegalmoves<movegen::MoveGenType::QUIET>(moves, board);
+				for (Move &move : moves)
+					move.setScore(thread.getQuietHistory(board, move, ss));
+				idx = 0;
+				stage = PickStage::QUIETS;
+				[[fallthrough]];
+			case PickStage::QUIETS:
+				while (idx < moves.size()){
+					Move move = pickBest();
+					if (move != ttMove && move != killer)
+						return move;
+				}
+				idx = 0;
+				stage = PickStage::BAD_CAPTURES;
+				[[fallthrough]];
+			case PickStage::BAD_CAPTURES:
+				if (idx < badCaptures.size())
+					return badCaptures[idx++];
+				stage = PickStage::DONE;
+				[[fallthrough]];
+			case PickStage::DONE:
+				return Move::NO_MOVE;
+		}
+		return Move::NO_MOVE;
+	}
+};
+
+}
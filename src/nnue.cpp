@@ -1,299 +1,861 @@
 #include "nnue.h"
 #include "search.h"
+#include "util.h"
 
 #include <fstream>
 #include <format>
 #include <algorithm>
+#include <cmath>
 #include <immintrin.h>
 #include <random>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+	#define NNUE_CAN_MAP
+#endif
 
 
-int16_t NNUE::ReLU_(int16_t x){
+template<typename Arch>
+int16_t BasicNNUE<Arch>::ReLU_(int16_t x) const {
 	return x < 0 ? 0 : x;
 }
 
-int16_t NNUE::CReLU_(int16_t x){
+template<typename Arch>
+int16_t BasicNNUE<Arch>::CReLU_(int16_t x) const {
 	if (x < 0)
 		return 0;
-	return x > QA ? QA : x;
+	return x > Arch::QA ? Arch::QA : x;
 }
 
-int32_t NNUE::SCReLU_(int16_t x){
+template<typename Arch>
+int32_t BasicNNUE<Arch>::SCReLU_(int16_t x) const {
 	if (x < 0)
 		return 0;
-	else if (x > QA)
-		return QA * QA;
+	else if (x > Arch::QA)
+		return Arch::QA * Arch::QA;
 	return x * x;
 }
-// Thanks Prelude and Turbulence
-// https://git.nocturn9x.space/Quinniboi10/Prelude/src/branch/main/src/nnue.cpp#L36
-#if defined(__x86_64__) || defined(__amd64__) || (defined(_WIN64) && (defined(_M_X64) || defined(_M_AMD64)))
-    #include <immintrin.h>
-    #if defined(__AVX512F__)
-        #pragma message("Using AVX512 NNUE inference")
-using nativeVector = __m512i;
-        #define set1_epi16 _mm512_set1_epi16
-        #define load_epi16 _mm512_load_si512
-        #define min_epi16 _mm512_min_epi16
-        #define max_epi16 _mm512_max_epi16
-        #define madd_epi16 _mm512_madd_epi16
-        #define mullo_epi16 _mm512_mullo_epi16
-        #define add_epi32 _mm512_add_epi32
-        #define reduce_epi32 _mm512_reduce_add_epi32
-    #elif defined(__AVX2__)
-        #pragma message("Using AVX2 NNUE inference")
-using nativeVector = __m256i;
-        #define set1_epi16 _mm256_set1_epi16
-        #define load_epi16 _mm256_load_si256
-        #define min_epi16 _mm256_min_epi16
-        #define max_epi16 _mm256_max_epi16
-        #define madd_epi16 _mm256_madd_epi16
-        #define mullo_epi16 _mm256_mullo_epi16
-        #define add_epi32 _mm256_add_epi32
-        #define reduce_epi32 \
-            [](nativeVector vec) { \
-                __m128i xmm1 = _mm256_extracti128_si256(vec, 1); \
-                __m128i xmm0 = _mm256_castsi256_si128(vec); \
-                xmm0         = _mm_add_epi32(xmm0, xmm1); \
-                xmm1         = _mm_shuffle_epi32(xmm0, 238); \
-                xmm0         = _mm_add_epi32(xmm0, xmm1); \
-                xmm1         = _mm_shuffle_epi32(xmm0, 85); \
-                xmm0         = _mm_add_epi32(xmm0, xmm1); \
-                return _mm_cvtsi128_si32(xmm0); \
-            }
-    #else
-        #pragma message("Using SSE NNUE inference")
-// Assumes SSE support here
-using nativeVector = __m128i;
-        #define set1_epi16 _mm_set1_epi16
-        #define load_epi16 _mm_load_si128
-        #define min_epi16 _mm_min_epi16
-        #define max_epi16 _mm_max_epi16
-        #define madd_epi16 _mm_madd_epi16
-        #define mullo_epi16 _mm_mullo_epi16
-        #define add_epi32 _mm_add_epi32
-        #define reduce_epi32 \
-            [](nativeVector vec) { \
-                __m128i xmm1 = _mm_shuffle_epi32(vec, 238); \
-                vec          = _mm_add_epi32(vec, xmm1); \
-                xmm1         = _mm_shuffle_epi32(vec, 85); \
-                vec          = _mm_add_epi32(vec, xmm1); \
-                return _mm_cvtsi128_si32(vec); \
-            }
-    #endif
-// https://github.com/official-stockfish/nnue-pytorch/blob/master/docs/nnue.md
-// https://cosmo.tardis.ac/files/2024-06-01-nnue.html
-// https://git.nocturn9x.space/Quinniboi10/Prelude/src/branch/main/src/nnue.cpp#L90
-int32_t NNUE::optimizedSCReLU(const std::array<int16_t, HL_N> &STM, const std::array<int16_t, HL_N> &OPP, Color col, size_t bucket){
-	const size_t VECTOR_SIZE = sizeof(nativeVector) / sizeof(int16_t);
-	static_assert(HL_N % VECTOR_SIZE == 0, "HL size must be divisible by the native register size of your CPU for vectorization to work");
-	const nativeVector VEC_QA   = set1_epi16(QA);
-	const nativeVector VEC_ZERO = set1_epi16(0);
-
-
-	nativeVector accumulator{};
-	for (size_t i=0;i<HL_N;i+=VECTOR_SIZE){
-		// load a SIMD vector of inputs, x
-		const nativeVector stmAccumValues  = load_epi16(reinterpret_cast<const nativeVector*>(&STM[i]));
-		const nativeVector nstmAccumValues = load_epi16(reinterpret_cast<const nativeVector*>(&OPP[i]));
-
-		// compute the clipped ReLU of the inputs, v
-		const nativeVector stmClamped  = min_epi16(VEC_QA, max_epi16(stmAccumValues, VEC_ZERO));
-		const nativeVector nstmClamped = min_epi16(VEC_QA, max_epi16(nstmAccumValues, VEC_ZERO));
-
-		// load the weights, w
-		const nativeVector stmWeights  = load_epi16(reinterpret_cast<const nativeVector*>(&OW[bucket][i]));
-		const nativeVector nstmWeights = load_epi16(reinterpret_cast<const nativeVector*>(&OW[bucket][i + HL_N]));
-
-		// SCReLU it
-		const nativeVector stmActivated  = madd_epi16(stmClamped, mullo_epi16(stmClamped, stmWeights));
-		const nativeVector nstmActivated = madd_epi16(nstmClamped, mullo_epi16(nstmClamped, nstmWeights));
-
-		accumulator = add_epi32(accumulator, stmActivated);
-		accumulator = add_epi32(accumulator, nstmActivated);
-	}
-	return reduce_epi32(accumulator);
-} 
-
-#else
 
-int32_t NNUE::optimizedSCReLU(const std::array<int16_t, HL_N> &STM, const std::array<int16_t, HL_N> &OPP, Color col, size_t bucket){
+// Every instruction set gets its own copy of the kernels so one binary runs anywhere
+// The fastest copy this CPU supports is picked once at startup, separately for each architecture
+struct NNUEKernels {
+	const char *name;
+	// int16 lanes per vector, which decides the int8 output weight layout
+	size_t width;
+	void (*addRow)(int16_t *acc, const int16_t *add);
+	void (*subRow)(int16_t *acc, const int16_t *sub);
+	void (*addSub)(int16_t *out, const int16_t *in, const int16_t *add, const int16_t *sub);
+	void (*addSubSub)(int16_t *out, const int16_t *in, const int16_t *add, const int16_t *sub1, const int16_t *sub2);
+	void (*addAddSubSub)(int16_t *out, const int16_t *in, const int16_t *add1, const int16_t *add2, const int16_t *sub1, const int16_t *sub2);
+	int32_t (*outputSCReLU)(const int16_t *STM, const int16_t *OPP, const int16_t *weights);
+	int32_t (*outputSCReLU8)(const int16_t *STM, const int16_t *OPP, const int8_t *weights);
+	// Deep nets only
+	void (*activateSparse)(const int16_t *in, uint8_t *out);
+	int (*findNonZero)(const uint8_t *in, uint16_t *indices);
+	void (*sparseL1)(const uint8_t *in, const uint16_t *indices, int count, const int8_t *weights, int32_t *out);
+};
+
+namespace scalar {
+
+template<typename Arch>
+void addRow(int16_t *acc, const int16_t *add){
+	for (int i=0;i<Arch::HIDDEN;i++)
+		acc[i] += add[i];
+}
+template<typename Arch>
+void subRow(int16_t *acc, const int16_t *sub){
+	for (int i=0;i<Arch::HIDDEN;i++)
+		acc[i] -= sub[i];
+}
+template<typename Arch>
+void addSub(int16_t *out, const int16_t *in, const int16_t *add, const int16_t *sub){
+	for (int i=0;i<Arch::HIDDEN;i++)
+		out[i] = in[i] + add[i] - sub[i];
+}
+template<typename Arch>
+void addSubSub(int16_t *out, const int16_t *in, const int16_t *add, const int16_t *sub1, const int16_t *sub2){
+	for (int i=0;i<Arch::HIDDEN;i++)
+		out[i] = in[i] + add[i] - sub1[i] - sub2[i];
+}
+template<typename Arch>
+void addAddSubSub(int16_t *out, const int16_t *in, const int16_t *add1, const int16_t *add2, const int16_t *sub1, const int16_t *sub2){
+	for (int i=0;i<Arch::HIDDEN;i++)
+		out[i] = in[i] + add1[i] + add2[i] - sub1[i] - sub2[i];
+}
+template<typename Arch>
+int32_t outputSCReLU(const int16_t *STM, const int16_t *OPP, const int16_t *weights){
+	const auto activate = [](int16_t x){
+		const int32_t c = std::clamp<int32_t>(x, 0, Arch::QA);
+		return c * c;
+	};
+	int32_t eval = 0;
+	for (int i=0;i<Arch::HIDDEN;i++){
+		eval += activate(STM[i]) * weights[i];
+		eval += activate(OPP[i]) * weights[Arch::HIDDEN+i];
+	}
+	return eval;
+}
+template<typename Arch>
+int32_t outputSCReLU8(const int16_t *STM, const int16_t *OPP, const int8_t *weights){
+	const auto activate = [](int16_t x){
+		const int32_t c = std::clamp<int32_t>(x, 0, Arch::QA);
+		return (c * c + (1 << (OUTPUT8_SHIFT - 1))) >> OUTPUT8_SHIFT;
+	};
 	int32_t eval = 0;
-	for (int i=0;i<HL_N;i++){
-		eval += SCReLU_(STM[i]) * OW[bucket][i];
-		eval += SCReLU_(OPP[i]) * OW[bucket][HL_N+i];
+	for (int i=0;i<Arch::HIDDEN;i++){
+		eval += activate(STM[i]) * weights[i];
+		eval += activate(OPP[i]) * weights[Arch::HIDDEN+i];
 	}
 	return eval;
 }
 
+template<typename Arch>
+void activateSparse(const int16_t *in, uint8_t *out){
+	for (int i=0;i<Arch::HIDDEN;i++){
+		const int32_t c = std::clamp<int32_t>(in[i], 0, Arch::QA);
+		out[i] = (c * c + (1 << (OUTPUT8_SHIFT - 1))) >> OUTPUT8_SHIFT;
+	}
+}
+template<typename Arch>
+int findNonZero(const uint8_t *in, uint16_t *indices){
+	int count = 0;
+	for (int i=0;i<2*Arch::HIDDEN;i+=4)
+		if (in[i] | in[i+1] | in[i+2] | in[i+3])
+			indices[count++] = i / 4;
+	return count;
+}
+template<typename Arch>
+void sparseL1(const uint8_t *in, const uint16_t *indices, int count, const int8_t *weights, int32_t *out){
+	std::fill(out, out + Arch::L1, 0);
+	for (int k=0;k<count;k++){
+		const uint8_t *block = &in[indices[k] * 4];
+		const int8_t *w = &weights[indices[k] * Arch::L1 * 4];
+		for (int o=0;o<Arch::L1;o++)
+			for (int b=0;b<4;b++)
+				out[o] += block[b] * w[o * 4 + b];
+	}
+}
+
+// A width of 8 is a single 128 bit lane, where packing keeps everything in order
+template<typename Arch>
+constexpr NNUEKernels kernels = {"scalar", 8, addRow<Arch>, subRow<Arch>, addSub<Arch>, addSubSub<Arch>,
+	addAddSubSub<Arch>, outputSCReLU<Arch>, outputSCReLU8<Arch>, activateSparse<Arch>, findNonZero<Arch>, sparseL1<Arch>};
+
+}
+
+// Thanks Prelude and Turbulence
+// https://git.nocturn9x.space/Quinniboi10/Prelude/src/branch/main/src/nnue.cpp#L36
+#if defined(__x86_64__) || defined(__amd64__) || (defined(_WIN64) && (defined(_M_X64) || defined(_M_AMD64)))
+	#define KERNEL_NAMESPACE sse41
+	#define KERNEL_TARGET "sse4.1"
+	#define KERNEL_WIDTH 128
+	#define KERNEL_NAME "SSE4.1"
+	#include "nnue_kernels.h"
+
+	#define KERNEL_NAMESPACE avx2
+	#define KERNEL_TARGET "avx2"
+	#define KERNEL_WIDTH 256
+	#define KERNEL_NAME "AVX2"
+	#include "nnue_kernels.h"
+
+	#define KERNEL_NAMESPACE avxvnni
+	#define KERNEL_TARGET "avx2,avxvnni"
+	#define KERNEL_WIDTH 256
+	#define KERNEL_NAME "AVX-VNNI"
+	#define KERNEL_VNNI
+	#include "nnue_kernels.h"
+
+	#define KERNEL_NAMESPACE avx512
+	#define KERNEL_TARGET "avx512f,avx512bw"
+	#define KERNEL_WIDTH 512
+	#define KERNEL_NAME "AVX-512BW"
+	#include "nnue_kernels.h"
+
+	#define KERNEL_NAMESPACE avx512vnni
+	#define KERNEL_TARGET "avx512f,avx512bw,avx512vnni"
+	#define KERNEL_WIDTH 512
+	#define KERNEL_NAME "AVX-512 VNNI"
+	#define KERNEL_VNNI
+	#include "nnue_kernels.h"
+
+template<typename Arch>
+const NNUEKernels &selectKernels(){
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512vnni") && __builtin_cpu_supports("avx512bw"))
+		return avx512vnni::kernels<Arch>;
+	if (__builtin_cpu_supports("avx512bw"))
+		return avx512::kernels<Arch>;
+	if (__builtin_cpu_supports("avxvnni"))
+		return avxvnni::kernels<Arch>;
+	if (__builtin_cpu_supports("avx2"))
+		return avx2::kernels<Arch>;
+	if (__builtin_cpu_supports("sse4.1"))
+		return sse41::kernels<Arch>;
+	return scalar::kernels<Arch>;
+}
+#else
+template<typename Arch>
+const NNUEKernels &selectKernels(){
+	return scalar::kernels<Arch>;
+}
 #endif
 
-int NNUE::feature(Color persp, Color color, PieceType p, Square sq){
+template<typename Arch>
+const NNUEKernels &kernels = selectKernels<Arch>();
+
+template<typename Arch>
+const char *BasicNNUE<Arch>::kernelName(){
+	return kernels<Arch>.name;
+}
+
+template<typename Arch>
+int32_t BasicNNUE<Arch>::optimizedSCReLU(const std::array<int16_t, HIDDEN> &STM, const std::array<int16_t, HIDDEN> &OPP, Color col, size_t bucket) const requires (!Arch::DEEP) {
+	return kernels<Arch>.outputSCReLU(STM.data(), OPP.data(), weights->OW[bucket].data());
+}
+
+// Result is on the same scale as optimizedSCReLU / QA
+template<typename Arch>
+int64_t BasicNNUE<Arch>::outputSCReLU8(const std::array<int16_t, HIDDEN> &STM, const std::array<int16_t, HIDDEN> &OPP, size_t bucket) const requires (!Arch::DEEP) {
+	const int64_t sum = kernels<Arch>.outputSCReLU8(STM.data(), OPP.data(), OW8[bucket].data());
+	return (sum << (OUTPUT8_SHIFT + OW8Shift)) / Arch::QA;
+}
+
+template<typename Arch>
+int BasicNNUE<Arch>::feature(Color persp, Color color, PieceType p, Square sq){
 	int ci = persp == color ? 0 : 1;
 	int sqi = persp == Color::BLACK ? (sq).flip().index() : (sq).index();
 	return ci * 64 * 6 + (int)p * 64 + sqi; // Index of the feature
 }
 
-void NNUE::load(const std::string &file){
-	std::ifstream stream(file, std::ios::binary);
+// Identifies the weights, e.g. so a saved hash table is only reused with the same net
+// Reads through memcpy since the embedded net isn't necessarily aligned
+template<typename Arch>
+static uint64_t hashWeights(const char *data){
+	uint64_t hash = 0;
+	const auto hashArray = [&](size_t offset, size_t count){
+		for (size_t i=0;i<count;i++){
+			int16_t v;
+			std::memcpy(&v, data + offset + i * sizeof(int16_t), sizeof(v));
+			hash = murmurHash3(hash ^ static_cast<uint16_t>(v));
+		}
+	};
+	hashArray(offsetof(NNUEWeights<Arch>, H1), Arch::HIDDEN * 768);
+	hashArray(offsetof(NNUEWeights<Arch>, H1Bias), Arch::HIDDEN);
+	if constexpr (Arch::DEEP)
+		// Everything after the accumulator, as raw 16 bit words
+		hashArray(offsetof(NNUEWeights<Arch>, L1W), (sizeof(NNUEWeights<Arch>) - offsetof(NNUEWeights<Arch>, L1W)) / sizeof(int16_t));
+	else {
+		hashArray(offsetof(NNUEWeights<Arch>, OW), Arch::HIDDEN * 2 * Arch::BUCKETS);
+		hashArray(offsetof(NNUEWeights<Arch>, outputBias), Arch::BUCKETS);
+	}
+	return hash;
+}
+
+template<typename Arch>
+void BasicNNUE<Arch>::release(){
+	#if defined(NNUE_CAN_MAP)
+		if (mapping != nullptr)
+			munmap(mapping, mappingBytes);
+	#endif
+	mapping = nullptr;
+	mappingBytes = 0;
+	owned.reset();
+}
+
+template<typename Arch>
+const NNUEWeights<Arch> *BasicNNUE<Arch>::parse(const char *data, size_t bytes, uint64_t &checksum, std::string &error){
+	NetHeader header{};
+	if (bytes >= sizeof(header))
+		std::memcpy(&header, data, sizeof(header));
+
+	if (!header.hasMagic()){
+		if (bytes != sizeof(Weights)){
+			error = "not a net file or a different architecture";
+			return nullptr;
+		}
+		checksum = hashWeights<Arch>(data);
+		return reinterpret_cast<const Weights*>(data);
+	}
+
+	if (const char *mismatch = header.mismatch<Arch>()){
+		error = mismatch;
+		return nullptr;
+	}
+	if (bytes != NET_HEADER_SIZE + sizeof(Weights)){
+		error = "truncated";
+		return nullptr;
+	}
+	checksum = hashWeights<Arch>(data + NET_HEADER_SIZE);
+	if (checksum != header.checksum){
+		error = "checksum mismatch";
+		return nullptr;
+	}
+	return reinterpret_cast<const Weights*>(data + NET_HEADER_SIZE);
+}
+
+template<typename Arch>
+void BasicNNUE<Arch>::adopt(const Weights *w, uint64_t checksum){
+	weights = w;
+	weightsChecksum = checksum;
+	if constexpr (Arch::DEEP)
+		prepareL1();
+	else
+		quantizeOutput();
+	generation++;
+}
+
+template<typename Arch>
+bool BasicNNUE<Arch>::load(const std::string &file, std::string &error){
+	#if defined(NNUE_CAN_MAP)
+		int fd = open(file.c_str(), O_RDONLY);
+		if (fd < 0){
+			error = "cannot open file";
+			return false;
+		}
+		struct stat st;
+		if (fstat(fd, &st) != 0 || st.st_size == 0){
+			close(fd);
+			error = "cannot read file";
+			return false;
+		}
+		const size_t bytes = st.st_size;
+		void *mem = mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (mem == MAP_FAILED){
+			error = "mmap failed";
+			return false;
+		}
+
+		uint64_t sum;
+		const Weights *w = parse(static_cast<const char*>(mem), bytes, sum, error);
+		if (w == nullptr){
+			munmap(mem, bytes);
+			return false;
+		}
+		release();
+		mapping = mem;
+		mappingBytes = bytes;
+		adopt(w, sum);
+		return true;
+	#else
+		std::ifstream stream(file, std::ios::binary | std::ios::ate);
+		if (!stream){
+			error = "cannot open file";
+			return false;
+		}
+		std::vector<char> data(static_cast<size_t>(stream.tellg()));
+		stream.seekg(0);
+		stream.read(data.data(), data.size());
+		return loadEmbedded(data.data(), data.size(), error);
+	#endif
+}
+
+template<typename Arch>
+bool BasicNNUE<Arch>::loadEmbedded(const void *data, size_t bytes, std::string &error){
+	uint64_t sum;
+	const Weights *w = parse(static_cast<const char*>(data), bytes, sum, error);
+	if (w == nullptr)
+		return false;
+	if (reinterpret_cast<uintptr_t>(w) % alignof(Weights) == 0){
+		release();
+		adopt(w, sum);
+	}
+	else {
+		std::unique_ptr<Weights> copy = std::make_unique<Weights>();
+		std::memcpy(static_cast<void*>(copy.get()), w, sizeof(Weights));
+		release();
+		owned = std::move(copy);
+		adopt(owned.get(), sum);
+	}
+	return true;
+}
+
+template<typename Arch>
+void BasicNNUE<Arch>::replicate(const BasicNNUE &other){
+	std::unique_ptr<Weights> copy = std::make_unique<Weights>();
+	std::memcpy(static_cast<void*>(copy.get()), other.weights, sizeof(Weights));
+	release();
+	owned = std::move(copy);
+	adopt(owned.get(), other.weightsChecksum);
+	int8Output = other.int8Output;
+}
+
+template<typename Arch>
+bool BasicNNUE<Arch>::save(const std::string &file) const {
+	std::ofstream out(file, std::ios::binary | std::ios::trunc);
+	if (!out)
+		return false;
+	std::array<char, NET_HEADER_SIZE> headerBytes{};
+	const NetHeader header = NetHeader::describe<Arch>(weightsChecksum);
+	std::memcpy(headerBytes.data(), &header, sizeof(header));
+	out.write(headerBytes.data(), headerBytes.size());
+	out.write(reinterpret_cast<const char*>(weights), sizeof(Weights));
+	return static_cast<bool>(out);
+}
+
+// Where the k-th uint8 a kernel of the given width packs comes from
+// Packing two vectors a and b of width int16s gives, for each 128 bit lane l,
+// 8 bytes of a starting at 8l then 8 bytes of b starting at 8l
+static size_t packedFrom(size_t k, size_t width){
+	const size_t chunk = k / (2 * width) * 2 * width;
+	const size_t lane = k % (2 * width) / 16;
+	const size_t r = k % 16;
+	return chunk + (r < 8 ? 8 * lane + r : width + 8 * lane + r - 8);
+}
+
+// Converts OW to int8, shifting all the weights down together if any of them don't fit
+// Nets trained with the usual weight clipping fit as is, so this is exact for them
+template<typename Arch>
+void BasicNNUE<Arch>::quantizeOutput() requires (!Arch::DEEP) {
+	int maxWeight = 0;
+	for (const auto &bucket : weights->OW)
+		for (const int16_t w : bucket)
+			maxWeight = std::max(maxWeight, std::abs(static_cast<int>(w)));
+	OW8Shift = 0;
+	while ((maxWeight >> OW8Shift) > 127)
+		OW8Shift++;
+
+	const size_t width = kernels<Arch>.width;
+	const int round = OW8Shift ? 1 << (OW8Shift - 1) : 0;
+	for (int i=0;i<Arch::BUCKETS;i++)
+		for (size_t k=0;k<HIDDEN*2;k++)
+			OW8[i][k] = static_cast<int8_t>(std::clamp((weights->OW[i][packedFrom(k, width)] + round) >> OW8Shift, -127, 127));
+}
+
+template<typename Arch>
+void BasicNNUE<Arch>::prepareL1() requires Arch::DEEP {
+	// Each perspective is packed separately, HIDDEN is a whole number of packs
+	const size_t width = kernels<Arch>.width;
+	for (int i=0;i<Arch::BUCKETS;i++)
+		for (size_t k=0;k<HIDDEN*2;k++){
+			const size_t input = k / HIDDEN * HIDDEN + packedFrom(k % HIDDEN, width);
+			for (int o=0;o<Arch::L1;o++)
+				L1Sparse[i][k / 4 * Arch::L1 * 4 + o * 4 + k % 4] = weights->L1W[i][o * HIDDEN * 2 + input];
+		}
+}
 
-	for (int i=0;i<H1.size();++i){
-		H1[i] = readLittleEndian<int16_t>(stream);
+// Keeps the HIDDEN neurons of big with the largest output weights, then refits the output layer by least squares
+// so the eval follows big's as closely as it can on every position up to 2 plies from fens
+// Only meant to tell won from lost, it is nowhere near as good as a trained net of the same size
+template<typename Arch>
+template<typename Big>
+void BasicNNUE<Arch>::shrink(const BasicNNUE<Big> &big, std::span<const std::string> fens) requires (!Arch::DEEP && !Big::DEEP) {
+	static_assert(Arch::HIDDEN < Big::HIDDEN && Arch::BUCKETS == Big::BUCKETS);
+	// A neuron can only move the output as far as its output weights let it
+	std::vector<std::pair<int, int>> importance(Big::HIDDEN);
+	for (int i=0;i<Big::HIDDEN;i++){
+		int sum = 0;
+		for (const auto &bucket : big.weights->OW)
+			sum += std::abs(bucket[i]) + std::abs(bucket[Big::HIDDEN + i]);
+		importance[i] = {sum, i};
 	}
-	for (int i=0;i<H1Bias.size();++i){
-		H1Bias[i] = readLittleEndian<int16_t>(stream);
+	std::sort(importance.begin(), importance.end(), std::greater<>());
+
+	std::unique_ptr<Weights> w = std::make_unique<Weights>();
+	for (int n=0;n<HIDDEN;n++){
+		const int i = importance[n].second;
+		for (int f=0;f<768;f++)
+			w->H1[f * HIDDEN + n] = big.weights->H1[f * Big::HIDDEN + i];
+		w->H1Bias[n] = big.weights->H1Bias[i];
 	}
-	for (int i=0;i<OW.size(); ++i) {
-		for (int j=0;j<OW[i].size();j++)
-			OW[i][j] = readLittleEndian<int16_t>(stream);
+
+	// Output layer as eval = sum x_i * W_i + W_bias per bucket, x being the activations in 0..1
+	// Solved from the normal equations, pulled towards big's weights for the neurons kept so buckets with few samples stay sane
+	constexpr int F = 2 * HIDDEN + 1;
+	constexpr double RIDGE = 1.0;
+	std::vector<std::vector<double>> XtX(Arch::BUCKETS, std::vector<double>(F * F));
+	std::vector<std::vector<double>> Xty(Arch::BUCKETS, std::vector<double>(F));
+	std::vector<std::vector<double>> prior(Arch::BUCKETS, std::vector<double>(F));
+	for (int b=0;b<Arch::BUCKETS;b++){
+		for (int n=0;n<HIDDEN;n++){
+			const int i = importance[n].second;
+			prior[b][n] = static_cast<double>(big.weights->OW[b][i]) * Arch::SCALE / Arch::QB;
+			prior[b][HIDDEN + n] = static_cast<double>(big.weights->OW[b][Big::HIDDEN + i]) * Arch::SCALE / Arch::QB;
+		}
+		prior[b][F - 1] = static_cast<double>(big.weights->outputBias[b]) * Arch::SCALE / (Arch::QA * Arch::QB);
+	}
+
+	release();
+	owned = std::move(w);
+	adopt(owned.get(), 0);
+
+	std::unique_ptr<BasicAccumulatorStack<Big>> bigAccs = std::make_unique<BasicAccumulatorStack<Big>>();
+	std::unique_ptr<AccumulatorStack> accs = std::make_unique<AccumulatorStack>();
+	const auto sample = [&](Board &board){
+		const Accumulator &acc = accs->current();
+		const Color stm = board.sideToMove();
+		const auto &STM = stm == Color::WHITE ? acc.white : acc.black;
+		const auto &OPP = stm == Color::WHITE ? acc.black : acc.white;
+		const size_t bucket = (board.occ().count()-2)/(32/Arch::BUCKETS);
+		std::array<double, F> x;
+		for (int i=0;i<HIDDEN;i++){
+			x[i] = SCReLU_(STM[i]) / static_cast<double>(Arch::QA * Arch::QA);
+			x[HIDDEN + i] = SCReLU_(OPP[i]) / static_cast<double>(Arch::QA * Arch::QA);
+		}
+		x[F - 1] = 1;
+		const double y = big.inference(&board, *bigAccs);
+		for (int i=0;i<F;i++){
+			Xty[bucket][i] += x[i] * y;
+			for (int j=0;j<F;j++)
+				XtX[bucket][i * F + j] += x[i] * x[j];
+		}
+	};
+	const auto push = [&](Board &board, Move m){
+		DirtyPieces &dirty = bigAccs->push();
+		DirtyFeatures(board, m, dirty);
+		accs->push() = dirty;
+		board.makeMove(m);
+	};
+	const auto pop = [&](Board &board, Move m){
+		board.unmakeMove(m);
+		bigAccs->pop();
+		accs->pop();
+	};
+	for (const std::string &fen : fens){
+		Board board(fen);
+		bigAccs->reset(big, board);
+		accs->reset(*this, board);
+		sample(board);
+		Movelist moves;
+		movegen::legalmoves(moves, board);
+		for (Move m : moves){
+			push(board, m);
+			sample(board);
+			Movelist replies;
+			movegen::legalmoves(replies, board);
+			for (Move r : replies){
+				push(board, r);
+				sample(board);
+				pop(board, r);
+			}
+			pop(board, m);
+		}
+	}
+
+	std::unique_ptr<Weights> fitted = std::make_unique<Weights>(*owned);
+	for (int b=0;b<Arch::BUCKETS;b++){
+		std::vector<double> &A = XtX[b];
+		std::vector<double> &y = Xty[b];
+		for (int i=0;i<F;i++){
+			A[i * F + i] += RIDGE;
+			y[i] += RIDGE * prior[b][i];
+		}
+		// Gaussian elimination with partial pivoting
+		for (int c=0;c<F;c++){
+			int pivot = c;
+			for (int r=c+1;r<F;r++)
+				if (std::abs(A[r * F + c]) > std::abs(A[pivot * F + c]))
+					pivot = r;
+			for (int k=0;k<F;k++)
+				std::swap(A[c * F + k], A[pivot * F + k]);
+			std::swap(y[c], y[pivot]);
+			for (int r=c+1;r<F;r++){
+				const double f = A[r * F + c] / A[c * F + c];
+				for (int k=c;k<F;k++)
+					A[r * F + k] -= f * A[c * F + k];
+				y[r] -= f * y[c];
+			}
+		}
+		std::array<double, F> W;
+		for (int c=F-1;c>=0;c--){
+			double v = y[c];
+			for (int k=c+1;k<F;k++)
+				v -= A[c * F + k] * W[k];
+			W[c] = v / A[c * F + c];
+		}
+		const auto quantize = [](double v){
+			return static_cast<int16_t>(std::clamp<double>(std::round(v), INT16_MIN, INT16_MAX));
+		};
+		for (int k=0;k<HIDDEN*2;k++)
+			fitted->OW[b][k] = quantize(W[k] * Arch::QB / Arch::SCALE);
+		fitted->outputBias[b] = quantize(W[F - 1] * Arch::QA * Arch::QB / Arch::SCALE);
 	}
-	for (int i=0;i<OUTPUT_BUCKETS;i++)
-		outputBias[i] = readLittleEndian<int16_t>(stream);
+	owned = std::move(fitted);
+	adopt(owned.get(), hashWeights<Arch>(reinterpret_cast<const char*>(owned.get())));
 }
 
-void NNUE::randomize(){
+template<typename Arch>
+void BasicNNUE<Arch>::randomize(){
 	std::random_device rd;
 	std::mt19937 gen(rd());
 	std::uniform_int_distribution<> distrib(-500, 500);
-	for (int i=0;i<H1.size();++i){
-		H1[i] = distrib(gen);
+	std::unique_ptr<Weights> w = std::make_unique<Weights>();
+	for (int i=0;i<w->H1.size();++i){
+		w->H1[i] = distrib(gen);
+	}
+	for (int i=0;i<w->H1Bias.size();++i){
+		w->H1Bias[i] = distrib(gen);
 	}
-	for (int i=0;i<H1Bias.size();++i){
-		H1Bias[i] = distrib(gen);
+	if constexpr (Arch::DEEP){
+		// int8 weights that the maddubs fallback can't saturate on, floats around what training gives
+		std::uniform_int_distribution<> l1(-127, 127);
+		std::uniform_real_distribution<float> real(-1, 1);
+		for (int i=0;i<Arch::BUCKETS;i++){
+			for (int8_t &x : w->L1W[i]) x = l1(gen);
+			for (float &x : w->L1Bias[i]) x = real(gen);
+			for (float &x : w->L2W[i]) x = real(gen);
+			for (float &x : w->L2Bias[i]) x = real(gen);
+			for (float &x : w->L3W[i]) x = real(gen);
+			w->L3Bias[i] = real(gen);
+		}
 	}
-	for (int i=0;i<OW.size(); ++i) {
-		for (int j=0;j<OW[i].size();j++)
-			OW[i][j] = distrib(gen);
+	else {
+		for (int i=0;i<w->OW.size(); ++i) {
+			for (int j=0;j<w->OW[i].size();j++)
+				w->OW[i][j] = distrib(gen);
+		}
+		for (int i=0;i<Arch::BUCKETS;i++)
+			w->outputBias[i] = distrib(gen);
 	}
-	for (int i=0;i<OUTPUT_BUCKETS;i++)
-		outputBias[i] = distrib(gen);
+	release();
+	owned = std::move(w);
+	adopt(owned.get(), hashWeights<Arch>(reinterpret_cast<const char*>(owned.get())));
 }
 
 
 
-int NNUE::inference(Board *board, Accumulator &accumulator){
+template<typename Arch>
+int BasicNNUE<Arch>::inference(Board *board, Accumulator &accumulator) const {
 
 	Color stm = board->sideToMove();
 
-	const std::array<int16_t, HL_N> &accumulatorSTM = stm == Color::WHITE ? accumulator.white : accumulator.black;
-	const std::array<int16_t, HL_N> &accumulatorOPP = stm == Color::BLACK ? accumulator.white : accumulator.black;
+	const std::array<int16_t, HIDDEN> &accumulatorSTM = stm == Color::WHITE ? accumulator.white : accumulator.black;
+	const std::array<int16_t, HIDDEN> &accumulatorOPP = stm == Color::BLACK ? accumulator.white : accumulator.black;
 
 	// Output buckets are calculated using piececount. Each bucket corresponds to (cnt-2)/(32/N)
-	const size_t outputBucket = (board->occ().count()-2)/(32/OUTPUT_BUCKETS);
+	const size_t outputBucket = (board->occ().count()-2)/(32/Arch::BUCKETS);
+
+	if constexpr (Arch::DEEP){
+		const NNUEKernels &k = kernels<Arch>;
+		alignas(64) std::array<uint8_t, HIDDEN * 2> activations;
+		alignas(64) std::array<uint16_t, HIDDEN * 2 / 4> nonZero;
+		alignas(64) std::array<int32_t, Arch::L1> l1;
+		k.activateSparse(accumulatorSTM.data(), activations.data());
+		k.activateSparse(accumulatorOPP.data(), activations.data() + HIDDEN);
+		const int count = k.findNonZero(activations.data(), nonZero.data());
+		k.sparseL1(activations.data(), nonZero.data(), count, L1Sparse[outputBucket].data(), l1.data());
+		return outputLayers(l1.data(), outputBucket);
+	}
+	else {
+		int64_t eval = 0;
 
-	int64_t eval = 0;
+		if (Arch::ACTIVATION != SCReLU){
 
-	if (ACTIVATION != SCReLU){
-		
-		for (int i=0;i<HL_N;i++){
-			if (ACTIVATION == CReLU){
-				eval += CReLU_(accumulatorSTM[i]) * OW[outputBucket][i];
-				eval += CReLU_(accumulatorOPP[i]) * OW[outputBucket][HL_N+i];
+			for (int i=0;i<HIDDEN;i++){
+				if (Arch::ACTIVATION == CReLU){
+					eval += CReLU_(accumulatorSTM[i]) * weights->OW[outputBucket][i];
+					eval += CReLU_(accumulatorOPP[i]) * weights->OW[outputBucket][HIDDEN+i];
+				}
 			}
 		}
+		else if (int8Output)
+			eval = outputSCReLU8(accumulatorSTM, accumulatorOPP, outputBucket);
+		else {
+			eval = optimizedSCReLU(accumulatorSTM, accumulatorOPP, stm, outputBucket);
+			eval /= Arch::QA;
+		}
+
+		eval += weights->outputBias[outputBucket];
+		return (eval * Arch::SCALE) / (Arch::QA * Arch::QB);
 	}
-	else {
-		eval = optimizedSCReLU(accumulatorSTM, accumulatorOPP, stm, outputBucket);
-		eval /= QA;
-	}
+}
 
-	eval += outputBias[outputBucket];
-	return (eval * NNUE_SCALE) / (QA * QB);
+template<typename Arch>
+int BasicNNUE<Arch>::outputLayers(const int32_t *l1, size_t bucket) const requires Arch::DEEP {
+	const auto screlu = [](float x){
+		x = std::clamp(x, 0.0f, 1.0f);
+		return x * x;
+	};
+	// L1's inputs are the activations times 2^OUTPUT8_SHIFT / QA^2 and its weights are times QB
+	constexpr float L1_SCALE = static_cast<float>(1 << OUTPUT8_SHIFT) / (static_cast<float>(Arch::QA) * Arch::QA * Arch::QB);
+	std::array<float, Arch::L1> hidden1;
+	for (int o=0;o<Arch::L1;o++)
+		hidden1[o] = screlu(l1[o] * L1_SCALE + weights->L1Bias[bucket][o]);
+	float out = weights->L3Bias[bucket];
+	for (int o=0;o<Arch::L2;o++){
+		float sum = weights->L2Bias[bucket][o];
+		for (int i=0;i<Arch::L1;i++)
+			sum += hidden1[i] * weights->L2W[bucket][o * Arch::L1 + i];
+		out += screlu(sum) * weights->L3W[bucket][o];
+	}
+	return static_cast<int>(out * Arch::SCALE);
+}
 
+template<typename Arch>
+int BasicNNUE<Arch>::referenceInference(Board *board, Accumulator &accumulator) const requires Arch::DEEP {
+	const Color stm = board->sideToMove();
+	const std::array<int16_t, HIDDEN> &accumulatorSTM = stm == Color::WHITE ? accumulator.white : accumulator.black;
+	const std::array<int16_t, HIDDEN> &accumulatorOPP = stm == Color::BLACK ? accumulator.white : accumulator.black;
+	const size_t outputBucket = (board->occ().count()-2)/(32/Arch::BUCKETS);
+	const auto activate = [](int16_t x){
+		const int32_t c = std::clamp<int32_t>(x, 0, Arch::QA);
+		return (c * c + (1 << (OUTPUT8_SHIFT - 1))) >> OUTPUT8_SHIFT;
+	};
+
+	std::array<int32_t, Arch::L1> l1{};
+	for (int o=0;o<Arch::L1;o++){
+		const int8_t *w = &weights->L1W[outputBucket][o * HIDDEN * 2];
+		for (int i=0;i<HIDDEN;i++)
+			l1[o] += activate(accumulatorSTM[i]) * w[i] + activate(accumulatorOPP[i]) * w[HIDDEN + i];
+	}
+	return outputLayers(l1.data(), outputBucket);
+}
 
+template<typename Arch>
+int BasicNNUE<Arch>::inference(Board *board, AccumulatorStack &accumulators) const {
+	return inference(board, accumulators.current());
 }
 
 // ------ Accumulator -------
 
-void Accumulator::refresh(Board &board){
+template<typename Arch>
+void BasicAccumulator<Arch>::refresh(const BasicNNUE<Arch> &net, Board &board){
+	const NNUEKernels &k = kernels<Arch>;
 	Bitboard whiteBB = board.us(Color::WHITE);
 	Bitboard blackBB = board.us(Color::BLACK);
 
 	// Obviously the bias is commutative so just add it first
-	white = network.H1Bias; 
-	black = network.H1Bias;
+	white = net.weights->H1Bias; 
+	black = net.weights->H1Bias;
 
 	while (whiteBB){
 		Square sq = whiteBB.pop();
 
 		// White features for both perspectives
-		int wf = NNUE::feature(Color::WHITE, Color::WHITE, board.at<PieceType>(sq), sq); 
-		int bf = NNUE::feature(Color::BLACK, Color::WHITE, board.at<PieceType>(sq), sq); 
+		int wf = BasicNNUE<Arch>::feature(Color::WHITE, Color::WHITE, board.at<PieceType>(sq), sq); 
+		int bf = BasicNNUE<Arch>::feature(Color::BLACK, Color::WHITE, board.at<PieceType>(sq), sq); 
 
-		for (int i=0;i<HL_N;i++){
-			// Do the matrix mutliply for the next layer
-			white[i] += network.H1[wf * HL_N + i];
-			black[i] += network.H1[bf * HL_N + i];
-		}
+		// Do the matrix mutliply for the next layer
+		k.addRow(white.data(), net.featureRow(wf));
+		k.addRow(black.data(), net.featureRow(bf));
 	}
 
 	while (blackBB){
 		Square sq = blackBB.pop();
 
 		// Black features for both perspectives
-		int wf = NNUE::feature(Color::WHITE, Color::BLACK, board.at<PieceType>(sq), sq); 
-		int bf = NNUE::feature(Color::BLACK, Color::BLACK, board.at<PieceType>(sq), sq); 
+		int wf = BasicNNUE<Arch>::feature(Color::WHITE, Color::BLACK, board.at<PieceType>(sq), sq); 
+		int bf = BasicNNUE<Arch>::feature(Color::BLACK, Color::BLACK, board.at<PieceType>(sq), sq); 
 
-		for (int i=0;i<HL_N;i++){
-			// Do the matrix mutliply for the next layer
-			white[i] += network.H1[wf * HL_N + i];
-			black[i] += network.H1[bf * HL_N + i];
-		}
+		k.addRow(white.data(), net.featureRow(wf));
+		k.addRow(black.data(), net.featureRow(bf));
 	}
 
 }
 
-void Accumulator::print(){
-	for (int i=0;i<HL_N;i++){
+template<typename Arch>
+void BasicAccumulator<Arch>::print(){
+	for (int i=0;i<Arch::HIDDEN;i++){
 		std::cout << "White: " << white[i] << " Black: " << black[i] << std::endl;
 	}
 }
 
-// Quiet Accumulation
-void Accumulator::quiet(Color stm, Square add, PieceType addPT, Square sub, PieceType subPT){
-
-	const int addW = NNUE::feature(Color::WHITE, stm, addPT, add);
-	const int addB = NNUE::feature(Color::BLACK, stm, addPT, add);
+template<typename Arch>
+void BasicAccumulator<Arch>::update(const BasicNNUE<Arch> &net, const BasicAccumulator &prev, const DirtyPieces &dirty){
+	const NNUEKernels &k = kernels<Arch>;
+	// Same dirty pieces from both perspectives
+	auto apply = [&](Color persp, int16_t *out, const int16_t *in){
+		const auto row = [&](const DirtyPiece &p){
+			return net.featureRow(BasicNNUE<Arch>::feature(persp, p.color, p.pt, p.sq));
+		};
+		if (dirty.addCount == 2)
+			k.addAddSubSub(out, in, row(dirty.adds[0]), row(dirty.adds[1]), row(dirty.subs[0]), row(dirty.subs[1]));
+		else if (dirty.subCount == 2)
+			k.addSubSub(out, in, row(dirty.adds[0]), row(dirty.subs[0]), row(dirty.subs[1]));
+		else
+			k.addSub(out, in, row(dirty.adds[0]), row(dirty.subs[0]));
+	};
+	apply(Color::WHITE, white.data(), prev.white.data());
+	apply(Color::BLACK, black.data(), prev.black.data());
+}
 
-	const int subW = NNUE::feature(Color::WHITE, stm, subPT, sub);
-	const int subB = NNUE::feature(Color::BLACK, stm, subPT, sub);
+// ------ Refresh Cache -------
 
-	for (int i=0;i<HL_N;i++){
-		white[i] += network.H1[addW * HL_N + i] - network.H1[subW * HL_N + i];
-		black[i] += network.H1[addB * HL_N + i] - network.H1[subB * HL_N + i];
+template<typename Arch>
+void BasicRefreshCache<Arch>::refresh(const BasicNNUE<Arch> &nnue, Board &board, BasicAccumulator<Arch> &accumulator){
+	constexpr std::array<PieceType, 6> pieceTypes = {PieceType::PAWN, PieceType::KNIGHT, PieceType::BISHOP, PieceType::ROOK, PieceType::QUEEN, PieceType::KING};
+	const NNUEKernels &k = kernels<Arch>;
+	if (net != &nnue || generation != nnue.generation){
+		invalidate();
+		net = &nnue;
+		generation = nnue.generation;
 	}
-}
-// Capture Accumulation
-void Accumulator::capture(Color stm, Square add, PieceType addPT, Square sub1, PieceType subPT1, Square sub2, PieceType subPT2){
-	const int addW = NNUE::feature(Color::WHITE, stm, addPT, add);
-	const int addB = NNUE::feature(Color::BLACK, stm, addPT, add);
-
-	const int subW1 = NNUE::feature(Color::WHITE, stm, subPT1, sub1);
-	const int subB1 = NNUE::feature(Color::BLACK, stm, subPT1, sub1);
+	for (Color persp : {Color::WHITE, Color::BLACK}){
+		Entry &entry = entries[(int)persp];
+		if (!entry.valid){
+			// An empty board is just the bias
+			entry.acc = nnue.weights->H1Bias;
+			for (auto &c : entry.pieces)
+				c.fill(Bitboard(0));
+			entry.valid = true;
+		}
 
-	const int subW2 = NNUE::feature(Color::WHITE, ~stm, subPT2, sub2);
-	const int subB2 = NNUE::feature(Color::BLACK, ~stm, subPT2, sub2);
+		std::array<int, 32> adds, subs;
+		int addCount = 0, subCount = 0;
+		for (Color c : {Color::WHITE, Color::BLACK}){
+			for (PieceType pt : pieceTypes){
+				const Bitboard now = board.pieces(pt, c);
+				Bitboard &prev = entry.pieces[(int)c][(int)pt];
+				Bitboard added = now & ~prev;
+				Bitboard removed = prev & ~now;
+				while (added)
+					adds[addCount++] = BasicNNUE<Arch>::feature(persp, c, pt, added.pop());
+				while (removed)
+					subs[subCount++] = BasicNNUE<Arch>::feature(persp, c, pt, removed.pop());
+				prev = now;
+			}
+		}
 
-	for (int i=0;i<HL_N;i++){
-		white[i] += network.H1[addW * HL_N + i] - network.H1[subW1 * HL_N + i] - network.H1[subW2 * HL_N + i];
-		black[i] += network.H1[addB * HL_N + i] - network.H1[subB1 * HL_N + i] - network.H1[subB2 * HL_N + i];
+		// Pair up adds and subs so most of the difference goes through the fused kernel
+		int16_t *acc = entry.acc.data();
+		int i = 0;
+		for (;i<std::min(addCount, subCount);i++)
+			k.addSub(acc, acc, nnue.featureRow(adds[i]), nnue.featureRow(subs[i]));
+		for (int j=i;j<addCount;j++)
+			k.addRow(acc, nnue.featureRow(adds[j]));
+		for (int j=i;j<subCount;j++)
+			k.subRow(acc, nnue.featureRow(subs[j]));
+
+		(persp == Color::WHITE ? accumulator.white : accumulator.black) = entry.acc;
 	}
 }
 
-// Undo Capture
-void Accumulator::uncapture(Color stm, Square add1, PieceType addPT1, Square add2, PieceType addPT2, Square sub, PieceType subPT){
-	const int addW1 = NNUE::feature(Color::WHITE, stm, addPT1, add1);
-	const int addB1 = NNUE::feature(Color::BLACK, stm, addPT1, add1);
-
-	const int addW2 = NNUE::feature(Color::WHITE, ~stm, addPT2, add2);
-	const int addB2 = NNUE::feature(Color::BLACK, ~stm, addPT2, add2);
-
-	const int subW = NNUE::feature(Color::WHITE, stm, subPT, sub);
-	const int subB = NNUE::feature(Color::BLACK, stm, subPT, sub);
-
-	for (int i=0;i<HL_N;i++){
-		white[i] += network.H1[addW1 * HL_N + i] + network.H1[addW2 * HL_N + i] - network.H1[subW * HL_N + i];
-		black[i] += network.H1[addB1 * HL_N + i] + network.H1[addB2 * HL_N + i] - network.H1[subB * HL_N + i];
+// ------ Accumulator Stack -------
+
+// Walk back to the last accumulator that is up to date and replay the moves since then
+template<typename Arch>
+BasicAccumulator<Arch> &BasicAccumulatorStack<Arch>::current(){
+	int last = idx;
+	while (!computed[last])
+		last--;
+	for (int i=last+1;i<=idx;i++){
+		stack[i].update(*net, stack[i-1], dirty[i]);
+		computed[i] = true;
 	}
+	return stack[idx];
 }
 
+template struct BasicNNUE<MainArch>;
+template struct BasicAccumulator<MainArch>;
+template struct BasicRefreshCache<MainArch>;
+template struct BasicAccumulatorStack<MainArch>;
+
+template struct BasicNNUE<WideArch>;
+template struct BasicAccumulator<WideArch>;
+template struct BasicRefreshCache<WideArch>;
+template struct BasicAccumulatorStack<WideArch>;
+
+template struct BasicNNUE<DeepArch>;
+template struct BasicAccumulator<DeepArch>;
+template struct BasicRefreshCache<DeepArch>;
+template struct BasicAccumulatorStack<DeepArch>;
+
+template struct BasicNNUE<SmallArch>;
+template struct BasicAccumulator<SmallArch>;
+template struct BasicRefreshCache<SmallArch>;
+template struct BasicAccumulatorStack<SmallArch>;
+template void BasicNNUE<SmallArch>::shrink(const BasicNNUE<MainArch>&, std::span<const std::string>);
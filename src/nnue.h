@@ -6,7 +6,11 @@
 #include <vector>
 #include <sstream>
 #include <cassert>
+#include <cstddef>
 #include <cstring>
+#include <memory>
+#include <span>
+#include <string>
 
 using namespace chess;
 
@@ -16,74 +20,312 @@ constexpr int SCReLU = 2;
 
 constexpr int ACTIVATION = SCReLU;
 
-const bool IS_LITTLE_ENDIAN = true;
-
-
-// stole from sf 
-template<typename IntType>
-inline IntType readLittleEndian(std::istream& stream) {
-    IntType result;
-
-    if (IS_LITTLE_ENDIAN)
-        stream.read(reinterpret_cast<char*>(&result), sizeof(IntType));
-    else {
-        std::uint8_t                  u[sizeof(IntType)];
-        std::make_unsigned_t<IntType> v = 0;
-
-        stream.read(reinterpret_cast<char*>(u), sizeof(IntType));
-        for (int i = 0; i < sizeof(IntType); ++i)
-            v = (v << 8) | u[sizeof(IntType) - i - 1];
-
-        std::memcpy(&result, &v, sizeof(IntType));
-    }
-
-    return result;
-}
-
-struct Accumulator {
-	#if defined(__x86_64__) || defined(__amd64__) || (defined(_WIN64) && (defined(_M_X64) || defined(_M_AMD64)))
-    	#if defined(__AVX512F__)
-			alignas(64) std::array<int16_t, HL_N> white;
-			alignas(64) std::array<int16_t, HL_N> black;
-		#else
-			alignas(32) std::array<int16_t, HL_N> white;
-			alignas(32) std::array<int16_t, HL_N> black;
-		#endif
-	#else
-		std::array<int16_t, HL_N> white;
-		std::array<int16_t, HL_N> black;
-	#endif
-
-	void refresh(Board &board);
+// Nets are used in place, straight from the file
+static_assert(std::endian::native == std::endian::little, "Net files are little endian");
+
+// Int8 output layer, SCReLU activations are rounded down from 0..QA*QA to 0..127
+constexpr int OUTPUT8_SHIFT = 9;
+
+// Shape and quantisation of a net
+// Everything below is a template over one of these, so nets of different shapes can live in the same binary
+// and each gets kernels compiled for its exact size
+// With L1Size set the net is (768->HIDDEN)x2->L1->L2->1 per output bucket instead of (768->HIDDEN)x2->1, and
+// Qb is the scale of the int8 L1 weights. Layers after L1 are small enough to just be float
+template<int HiddenSize, int OutputBuckets, int16_t Qa, int16_t Qb, int Scale, int Activation, int L1Size = 0, int L2Size = 0>
+struct Architecture {
+	static constexpr int HIDDEN = HiddenSize;
+	static constexpr int BUCKETS = OutputBuckets;
+	static constexpr int16_t QA = Qa;
+	static constexpr int16_t QB = Qb;
+	static constexpr int SCALE = Scale;
+	static constexpr int ACTIVATION = Activation;
+	static constexpr int L1 = L1Size;
+	static constexpr int L2 = L2Size;
+	static constexpr bool DEEP = L1 > 0;
+
+	static_assert(HIDDEN % 64 == 0, "Hidden layer has to be a whole number of the widest vectors twice over");
+	static_assert(32 % BUCKETS == 0);
+	static_assert(((QA * QA + (1 << (OUTPUT8_SHIFT - 1))) >> OUTPUT8_SHIFT) <= 127);
+	// L1 outputs have to fill whole vectors of int32s
+	static_assert(L1 % 16 == 0 && (L1 > 0) == (L2 > 0));
+	static_assert(!DEEP || Activation == SCReLU, "Deep nets feed L1 the same squared activations as the int8 output layer");
+};
+
+// The net search uses, parameters.h has its shape
+using MainArch = Architecture<HL_N, OUTPUT_BUCKETS, QA, QB, NNUE_SCALE, ACTIVATION>;
+// Compiled in so netbench can compare them against the main net
+using WideArch = Architecture<1024, OUTPUT_BUCKETS, QA, QB, NNUE_SCALE, ACTIVATION>;
+using DeepArch = Architecture<1024, OUTPUT_BUCKETS, QA, QB, NNUE_SCALE, SCReLU, 16, 32>;
+// Cheap net qsearch can use to stand pat in positions that are clearly outside the window, see SmallNet
+using SmallArch = Architecture<64, OUTPUT_BUCKETS, QA, QB, NNUE_SCALE, ACTIVATION>;
+
+
+// A piece that appeared on or left a square
+struct DirtyPiece {
+	Color color;
+	PieceType pt;
+	Square sq;
+};
+
+// The feature changes a move made
+// At most 2 adds (castling) and 2 subs (castling, captures, en passant)
+struct DirtyPieces {
+	std::array<DirtyPiece, 2> adds;
+	std::array<DirtyPiece, 2> subs;
+	uint8_t addCount;
+	uint8_t subCount;
+
+	void clear(){
+		addCount = 0;
+		subCount = 0;
+	}
+	void add(Color color, PieceType pt, Square sq){
+		adds[addCount++] = DirtyPiece{color, pt, sq};
+	}
+	void sub(Color color, PieceType pt, Square sq){
+		subs[subCount++] = DirtyPiece{color, pt, sq};
+	}
+};
+
+template<typename Arch> struct BasicNNUE;
+
+template<typename Arch>
+struct BasicAccumulator {
+	// Aligned for the widest kernels, which one runs is only known at startup
+	alignas(64) std::array<int16_t, Arch::HIDDEN> white;
+	alignas(64) std::array<int16_t, Arch::HIDDEN> black;
+
+	void refresh(const BasicNNUE<Arch> &net, Board &board);
 	void print();
-	// addsub, addsubsub, addaddsubsub
-	void quiet(Color stm, Square add, PieceType addPT, Square sub, PieceType subPT);
-	void capture(Color stm, Square add, PieceType addPT, Square sub1, PieceType subPT1, Square sub2, PieceType subPT2);
-	void uncapture(Color stm, Square add1, PieceType addPT1, Square add2, PieceType addPT2, Square sub, PieceType subPT);
-	void castle(Color stm, Square add1, PieceType addPT1, Square add2, PieceType addPT2, Square sub1, PieceType subPT1, Square sub2, PieceType subPT2);
+	// this = prev + dirty, addsub, addsubsub, addaddsubsub
+	void update(const BasicNNUE<Arch> &net, const BasicAccumulator &prev, const DirtyPieces &dirty);
 };
 
-struct NNUE {
-	std::array<int16_t, HL_N * 768> H1;
-	std::array<int16_t, HL_N> H1Bias;
-	std::array<std::array<int16_t, HL_N * 2>, OUTPUT_BUCKETS> OW;
-	std::array<int16_t, OUTPUT_BUCKETS> outputBias;
+// Finny table
+// Keeps, per perspective, the last accumulator built from scratch along with the pieces it was built from
+// Refreshing then only has to apply the difference between those pieces and the new position
+template<typename Arch>
+struct BasicRefreshCache {
+	struct Entry {
+		alignas(64) std::array<int16_t, Arch::HIDDEN> acc;
+		// indexed by [color][piece type]
+		std::array<std::array<Bitboard, 6>, 2> pieces;
+		bool valid = false;
+	};
+	std::array<Entry, 2> entries;
+	// Net and net.generation the entries were built with
+	const BasicNNUE<Arch> *net = nullptr;
+	uint64_t generation = 0;
 
-	int16_t ReLU_(int16_t x);
-	int16_t CReLU_(int16_t x);
-	int32_t SCReLU_(int16_t x);
+	void invalidate(){
+		for (Entry &e : entries)
+			e.valid = false;
+	}
+	void refresh(const BasicNNUE<Arch> &net, Board &board, BasicAccumulator<Arch> &accumulator);
+};
 
-	static int feature(Color persp, Color color, PieceType piece, Square square);
+// One accumulator per ply. Making a move only records what changed and the accumulator
+// is brought up to date when the position actually gets evaluated, unmaking is just a pop
+template<typename Arch>
+struct BasicAccumulatorStack {
+	std::array<BasicAccumulator<Arch>, MAX_PLY + 2> stack;
+	std::array<DirtyPieces, MAX_PLY + 2> dirty;
+	std::array<bool, MAX_PLY + 2> computed;
+	BasicRefreshCache<Arch> cache;
+	// Net the accumulators are for, set by reset
+	const BasicNNUE<Arch> *net = nullptr;
+	int idx;
 
-	void load(const std::string &file);
-	void randomize();
+	BasicAccumulatorStack(){
+		idx = 0;
+		computed.fill(false);
+	}
+	void reset(const BasicNNUE<Arch> &nnue, Board &board){
+		net = &nnue;
+		idx = 0;
+		cache.refresh(nnue, board, stack[0]);
+		computed[0] = true;
+	}
+	DirtyPieces &push(){
+		idx++;
+		assert(idx < (int)stack.size());
+		computed[idx] = false;
+		dirty[idx].clear();
+		return dirty[idx];
+	}
+	void pop(){
+		idx--;
+	}
+	BasicAccumulator<Arch> &current();
+};
+
+// Every layer starts on a cache line so the SIMD kernels can use aligned loads
+// This matches the padded layout bullet writes, so its output can be used as is
+template<typename Arch, bool Deep = Arch::DEEP>
+struct NNUEWeights {
+	alignas(64) std::array<int16_t, Arch::HIDDEN * 768> H1;
+	alignas(64) std::array<int16_t, Arch::HIDDEN> H1Bias;
+	alignas(64) std::array<std::array<int16_t, Arch::HIDDEN * 2>, Arch::BUCKETS> OW;
+	alignas(64) std::array<int16_t, Arch::BUCKETS> outputBias;
+};
+
+// Layers after the accumulator are per output bucket, weights are [bucket][output][input]
+template<typename Arch>
+struct NNUEWeights<Arch, true> {
+	alignas(64) std::array<int16_t, Arch::HIDDEN * 768> H1;
+	alignas(64) std::array<int16_t, Arch::HIDDEN> H1Bias;
+	alignas(64) std::array<std::array<int8_t, Arch::L1 * Arch::HIDDEN * 2>, Arch::BUCKETS> L1W;
+	alignas(64) std::array<std::array<float, Arch::L1>, Arch::BUCKETS> L1Bias;
+	alignas(64) std::array<std::array<float, Arch::L2 * Arch::L1>, Arch::BUCKETS> L2W;
+	alignas(64) std::array<std::array<float, Arch::L2>, Arch::BUCKETS> L2Bias;
+	alignas(64) std::array<std::array<float, Arch::L2>, Arch::BUCKETS> L3W;
+	alignas(64) std::array<float, Arch::BUCKETS> L3Bias;
+};
+
+// Net files are this header followed by the weights, see exportnet
+// The header takes a whole cache line so the weights after it stay aligned when mapped
+// Headerless files (bullet output and the embedded net) are still accepted if the size matches
+constexpr char NET_MAGIC[8] = {'T', 'A', 'R', 'N', 'N', 'N', 'U', 'E'};
+constexpr uint32_t NET_VERSION = 1;
+constexpr size_t NET_HEADER_SIZE = 64;
+
+struct NetHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t inputs;
+	uint32_t hiddenSize;
+	uint32_t outputBuckets;
+	int32_t qa;
+	int32_t qb;
+	int32_t scale;
+	// NNUE::checksum() of the weights
+	uint64_t checksum;
+	// Zero for single layer nets, which is also what files from before these existed have here
+	uint32_t l1;
+	uint32_t l2;
 
-	int32_t optimizedSCReLU(const std::array<int16_t, HL_N> &STM, const std::array<int16_t, HL_N> &OPP, Color col, size_t bucket);
-	int inference(Board *board, Accumulator &accumulator);
+	template<typename Arch>
+	static NetHeader describe(uint64_t checksum){
+		NetHeader h;
+		std::memcpy(h.magic, NET_MAGIC, sizeof(h.magic));
+		h.version = NET_VERSION;
+		h.inputs = 768;
+		h.hiddenSize = Arch::HIDDEN;
+		h.outputBuckets = Arch::BUCKETS;
+		h.qa = Arch::QA;
+		h.qb = Arch::QB;
+		h.scale = Arch::SCALE;
+		h.checksum = checksum;
+		h.l1 = Arch::L1;
+		h.l2 = Arch::L2;
+		return h;
+	}
+	bool hasMagic() const {
+		return std::memcmp(magic, NET_MAGIC, sizeof(magic)) == 0;
+	}
+	// Why this net can't be used as an Arch, or nullptr if it can
+	template<typename Arch>
+	const char *mismatch() const {
+		if (version != NET_VERSION)
+			return "unsupported version";
+		if (inputs != 768 || hiddenSize != Arch::HIDDEN || outputBuckets != Arch::BUCKETS || l1 != Arch::L1 || l2 != Arch::L2)
+			return "different architecture";
+		if (qa != Arch::QA || qb != Arch::QB || scale != Arch::SCALE)
+			return "different quantisation";
+		return nullptr;
+	}
 };
+static_assert(sizeof(NetHeader) <= NET_HEADER_SIZE);
 
+// Members are defined in nnue.cpp and instantiated there for MainArch, WideArch, DeepArch and SmallArch
+template<typename Arch>
+struct BasicNNUE {
+	using Weights = NNUEWeights<Arch>;
+	using Accumulator = BasicAccumulator<Arch>;
+	using AccumulatorStack = BasicAccumulatorStack<Arch>;
+	static constexpr int HIDDEN = Arch::HIDDEN;
+private:
+	// Non null when the weights are a read only mapping of a net file
+	void *mapping = nullptr;
+	size_t mappingBytes = 0;
+	// Set when the weights had to be copied or were generated
+	std::unique_ptr<Weights> owned;
+	uint64_t weightsChecksum = 0;
 
+	void release();
+	// Checks data is a usable net and returns where its weights start
+	static const Weights *parse(const char *data, size_t bytes, uint64_t &checksum, std::string &error);
+	// Recomputes everything derived from the weights
+	void adopt(const Weights *w, uint64_t checksum);
+	// Regroups L1 for sparseL1
+	void prepareL1() requires Arch::DEEP;
+	// Everything after L1 from its int32 sums
+	int outputLayers(const int32_t *l1, size_t bucket) const requires Arch::DEEP;
+public:
+	// Points into the mapping, owned, or the embedded net
+	const Weights *weights = nullptr;
 
+	// OW quantized to int8, see quantizeOutput()
+	alignas(64) std::array<std::array<int8_t, HIDDEN * 2>, Arch::BUCKETS> OW8;
+	int OW8Shift;
+	// Use the int8 output layer instead of the int16 one
+	bool int8Output = false;
+	// Deep nets, L1 weights as [bucket][block of 4 inputs][output][4] with the inputs in the order the activation kernel packs them
+	alignas(64) std::array<std::array<int8_t, HIDDEN * 2 * Arch::L1>, Arch::BUCKETS> L1Sparse;
+	// Bumped every time the weights change, so refresh caches know to start over
+	uint64_t generation = 0;
+
+	BasicNNUE() = default;
+	~BasicNNUE(){
+		release();
+	}
+	BasicNNUE(const BasicNNUE&) = delete;
+	BasicNNUE &operator=(const BasicNNUE&) = delete;
+
+	int16_t ReLU_(int16_t x) const;
+	int16_t CReLU_(int16_t x) const;
+	int32_t SCReLU_(int16_t x) const;
+
+	static int feature(Color persp, Color color, PieceType piece, Square square);
+
+	// Maps the file read only where possible, so loading is free and the pages are shared between processes
+	// On failure the current net is kept and error says why
+	bool load(const std::string &file, std::string &error);
+	// Uses data in place if it is aligned, else copies it
+	bool loadEmbedded(const void *data, size_t bytes, std::string &error);
+	// Private copy of other's weights, first touched by the calling thread so they land in its NUMA node's memory
+	void replicate(const BasicNNUE &other);
+	// Writes the current net with a header
+	bool save(const std::string &file) const;
+	void randomize();
+	// Builds this net out of a bigger one, see nnue.cpp
+	template<typename Big>
+	void shrink(const BasicNNUE<Big> &big, std::span<const std::string> fens) requires (!Arch::DEEP && !Big::DEEP);
+	void quantizeOutput() requires (!Arch::DEEP);
+	uint64_t checksum() const {
+		return weightsChecksum;
+	}
+	// Instruction set of the kernels picked for this CPU
+	static const char *kernelName();
+	// Row of H1 for a feature
+	const int16_t *featureRow(int feature) const {
+		return &weights->H1[feature * HIDDEN];
+	}
+
+	int32_t optimizedSCReLU(const std::array<int16_t, HIDDEN> &STM, const std::array<int16_t, HIDDEN> &OPP, Color col, size_t bucket) const requires (!Arch::DEEP);
+	int64_t outputSCReLU8(const std::array<int16_t, HIDDEN> &STM, const std::array<int16_t, HIDDEN> &OPP, size_t bucket) const requires (!Arch::DEEP);
+	int inference(Board *board, Accumulator &accumulator) const;
+	// Dense scalar L1 straight from the file layout, to check the sparse path against
+	int referenceInference(Board *board, Accumulator &accumulator) const requires Arch::DEEP;
+	int inference(Board *board, AccumulatorStack &accumulators) const;
+};
 
+using NNUE = BasicNNUE<MainArch>;
+using Accumulator = BasicAccumulator<MainArch>;
+using RefreshCache = BasicRefreshCache<MainArch>;
+using AccumulatorStack = BasicAccumulatorStack<MainArch>;
+using SmallNNUE = BasicNNUE<SmallArch>;
+using SmallAccumulatorStack = BasicAccumulatorStack<SmallArch>;
 
 extern NNUE network;
+extern SmallNNUE smallNetwork;
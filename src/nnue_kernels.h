@@ -0,0 +1,296 @@
+// No include guard, nnue.cpp includes this once per instruction set
+// Before including, define
+//   KERNEL_NAMESPACE  namespace the kernels go in
+//   KERNEL_TARGET     target string the functions are compiled for, e.g. "avx2"
+//   KERNEL_WIDTH      vector width in bits, 128, 256 or 512
+//   KERNEL_NAME       what uci reports
+//   KERNEL_VNNI       optional, fuse the multiply adds and accumulates with vpdpwssd/vpdpbusd
+// Everything defined here is undefined again at the end
+
+#include <immintrin.h>
+
+#define KERNEL_PRAGMA_(x) _Pragma(#x)
+#define KERNEL_PRAGMA(x) KERNEL_PRAGMA_(x)
+
+#if defined(__clang__)
+	KERNEL_PRAGMA(clang attribute push(__attribute__((target(KERNEL_TARGET))), apply_to = function))
+#else
+	#pragma GCC push_options
+	KERNEL_PRAGMA(GCC target(KERNEL_TARGET))
+#endif
+
+namespace KERNEL_NAMESPACE {
+
+#if KERNEL_WIDTH == 512
+using nativeVector = __m512i;
+	#define set1_epi16 _mm512_set1_epi16
+	#define load_epi16 _mm512_load_si512
+	#define store_epi16 _mm512_store_si512
+	#define min_epi16 _mm512_min_epi16
+	#define max_epi16 _mm512_max_epi16
+	#define madd_epi16 _mm512_madd_epi16
+	#define mullo_epi16 _mm512_mullo_epi16
+	#define add_epi32 _mm512_add_epi32
+	#define add_epi16 _mm512_add_epi16
+	#define sub_epi16 _mm512_sub_epi16
+	#define maddubs_epi16 _mm512_maddubs_epi16
+	#define vnni_dpwssd _mm512_dpwssd_epi32
+	#define vnni_dpbusd _mm512_dpbusd_epi32
+inline int32_t reduce_epi32(nativeVector vec){
+	return _mm512_reduce_add_epi32(vec);
+}
+	#define packus_epi16 _mm512_packus_epi16
+	#define slli_epi16 _mm512_slli_epi16
+	#define mulhrs_epi16 _mm512_mulhrs_epi16
+	#define set1_epi32 _mm512_set1_epi32
+// One bit per int32 that isn't zero
+inline uint32_t nonZeroMask(nativeVector vec){
+	return _mm512_test_epi32_mask(vec, vec);
+}
+#elif KERNEL_WIDTH == 256
+using nativeVector = __m256i;
+	#define set1_epi16 _mm256_set1_epi16
+	#define load_epi16 _mm256_load_si256
+	#define store_epi16 _mm256_store_si256
+	#define min_epi16 _mm256_min_epi16
+	#define max_epi16 _mm256_max_epi16
+	#define madd_epi16 _mm256_madd_epi16
+	#define mullo_epi16 _mm256_mullo_epi16
+	#define add_epi32 _mm256_add_epi32
+	#define add_epi16 _mm256_add_epi16
+	#define sub_epi16 _mm256_sub_epi16
+	#define maddubs_epi16 _mm256_maddubs_epi16
+	#define vnni_dpwssd _mm256_dpwssd_avx_epi32
+	#define vnni_dpbusd _mm256_dpbusd_avx_epi32
+	#define packus_epi16 _mm256_packus_epi16
+	#define slli_epi16 _mm256_slli_epi16
+	#define mulhrs_epi16 _mm256_mulhrs_epi16
+	#define set1_epi32 _mm256_set1_epi32
+inline uint32_t nonZeroMask(nativeVector vec){
+	return ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(vec, _mm256_setzero_si256()))) & 0xFF;
+}
+inline int32_t reduce_epi32(nativeVector vec){
+	__m128i xmm1 = _mm256_extracti128_si256(vec, 1);
+	__m128i xmm0 = _mm256_castsi256_si128(vec);
+	xmm0 = _mm_add_epi32(xmm0, xmm1);
+	xmm1 = _mm_shuffle_epi32(xmm0, 238);
+	xmm0 = _mm_add_epi32(xmm0, xmm1);
+	xmm1 = _mm_shuffle_epi32(xmm0, 85);
+	xmm0 = _mm_add_epi32(xmm0, xmm1);
+	return _mm_cvtsi128_si32(xmm0);
+}
+#else
+using nativeVector = __m128i;
+	#define set1_epi16 _mm_set1_epi16
+	#define load_epi16 _mm_load_si128
+	#define store_epi16 _mm_store_si128
+	#define min_epi16 _mm_min_epi16
+	#define max_epi16 _mm_max_epi16
+	#define madd_epi16 _mm_madd_epi16
+	#define mullo_epi16 _mm_mullo_epi16
+	#define add_epi32 _mm_add_epi32
+	#define add_epi16 _mm_add_epi16
+	#define sub_epi16 _mm_sub_epi16
+	#define maddubs_epi16 _mm_maddubs_epi16
+	#define packus_epi16 _mm_packus_epi16
+	#define slli_epi16 _mm_slli_epi16
+	#define mulhrs_epi16 _mm_mulhrs_epi16
+	#define set1_epi32 _mm_set1_epi32
+inline uint32_t nonZeroMask(nativeVector vec){
+	return ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(vec, _mm_setzero_si128()))) & 0xF;
+}
+inline int32_t reduce_epi32(nativeVector vec){
+	__m128i xmm1 = _mm_shuffle_epi32(vec, 238);
+	vec = _mm_add_epi32(vec, xmm1);
+	xmm1 = _mm_shuffle_epi32(vec, 85);
+	vec = _mm_add_epi32(vec, xmm1);
+	return _mm_cvtsi128_si32(vec);
+}
+#endif
+
+// dpwssd is acc + madd(a, b) on int16, dpbusd the same on 4 uint8 * int8 products
+#if defined(KERNEL_VNNI)
+	#define dpwssd_epi32 vnni_dpwssd
+	#define dpbusd_epi32 vnni_dpbusd
+#else
+	#define dpwssd_epi32(acc, a, b) add_epi32(acc, madd_epi16(a, b))
+	#define dpbusd_epi32(acc, a, b) add_epi32(acc, madd_epi16(maddubs_epi16(a, b), set1_epi16(1)))
+#endif
+
+constexpr size_t I16_VECTOR_SIZE = sizeof(nativeVector) / sizeof(int16_t);
+
+// Templates over the architecture so every net shape gets loops with a constant trip count
+// Instantiations keep the target of the surrounding pragma
+
+// Fused accumulator kernels, every vector of the accumulator is loaded and stored exactly once
+// and stays in a register while all the feature rows are applied to it. out may alias in
+inline nativeVector loadRow(const int16_t *row, size_t i){
+	return load_epi16(reinterpret_cast<const nativeVector*>(&row[i]));
+}
+inline void storeRow(int16_t *row, size_t i, nativeVector v){
+	store_epi16(reinterpret_cast<nativeVector*>(&row[i]), v);
+}
+template<typename Arch>
+void addRow(int16_t *acc, const int16_t *add){
+	for (size_t i=0;i<Arch::HIDDEN;i+=I16_VECTOR_SIZE)
+		storeRow(acc, i, add_epi16(loadRow(acc, i), loadRow(add, i)));
+}
+template<typename Arch>
+void subRow(int16_t *acc, const int16_t *sub){
+	for (size_t i=0;i<Arch::HIDDEN;i+=I16_VECTOR_SIZE)
+		storeRow(acc, i, sub_epi16(loadRow(acc, i), loadRow(sub, i)));
+}
+template<typename Arch>
+void addSub(int16_t *out, const int16_t *in, const int16_t *add, const int16_t *sub){
+	for (size_t i=0;i<Arch::HIDDEN;i+=I16_VECTOR_SIZE)
+		storeRow(out, i, sub_epi16(add_epi16(loadRow(in, i), loadRow(add, i)), loadRow(sub, i)));
+}
+template<typename Arch>
+void addSubSub(int16_t *out, const int16_t *in, const int16_t *add, const int16_t *sub1, const int16_t *sub2){
+	for (size_t i=0;i<Arch::HIDDEN;i+=I16_VECTOR_SIZE){
+		nativeVector v = add_epi16(loadRow(in, i), loadRow(add, i));
+		v = sub_epi16(v, loadRow(sub1, i));
+		storeRow(out, i, sub_epi16(v, loadRow(sub2, i)));
+	}
+}
+template<typename Arch>
+void addAddSubSub(int16_t *out, const int16_t *in, const int16_t *add1, const int16_t *add2, const int16_t *sub1, const int16_t *sub2){
+	for (size_t i=0;i<Arch::HIDDEN;i+=I16_VECTOR_SIZE){
+		nativeVector v = add_epi16(loadRow(in, i), loadRow(add1, i));
+		v = add_epi16(v, loadRow(add2, i));
+		v = sub_epi16(v, loadRow(sub1, i));
+		storeRow(out, i, sub_epi16(v, loadRow(sub2, i)));
+	}
+}
+
+// https://github.com/official-stockfish/nnue-pytorch/blob/master/docs/nnue.md
+// https://cosmo.tardis.ac/files/2024-06-01-nnue.html
+// https://git.nocturn9x.space/Quinniboi10/Prelude/src/branch/main/src/nnue.cpp#L90
+template<typename Arch>
+int32_t outputSCReLU(const int16_t *STM, const int16_t *OPP, const int16_t *weights){
+	static_assert(Arch::HIDDEN % (2 * I16_VECTOR_SIZE) == 0, "HL size must be divisible by the native register size of your CPU for vectorization to work");
+	const nativeVector VEC_QA   = set1_epi16(Arch::QA);
+	const nativeVector VEC_ZERO = set1_epi16(0);
+
+	// Separate sums for each side so the dependency chains can overlap, vpdpwssd has a latency of 5 or so
+	nativeVector stmSum = set1_epi16(0);
+	nativeVector nstmSum = set1_epi16(0);
+	for (size_t i=0;i<Arch::HIDDEN;i+=I16_VECTOR_SIZE){
+		// compute the clipped ReLU of the inputs, v
+		const nativeVector stmClamped  = min_epi16(VEC_QA, max_epi16(loadRow(STM, i), VEC_ZERO));
+		const nativeVector nstmClamped = min_epi16(VEC_QA, max_epi16(loadRow(OPP, i), VEC_ZERO));
+
+		// load the weights, w
+		const nativeVector stmWeights  = loadRow(weights, i);
+		const nativeVector nstmWeights = loadRow(weights, i + Arch::HIDDEN);
+
+		// SCReLU it, v * (v * w) summed in pairs into 32 bits
+		stmSum = dpwssd_epi32(stmSum, stmClamped, mullo_epi16(stmClamped, stmWeights));
+		nstmSum = dpwssd_epi32(nstmSum, nstmClamped, mullo_epi16(nstmClamped, nstmWeights));
+	}
+	return reduce_epi32(add_epi32(stmSum, nstmSum));
+}
+
+// Same thing with the activations squared down to 0..127 and packed to uint8, against int8 weights
+// Twice the activations per instruction, and 127 * 127 * 2 keeps the maddubs fallback from saturating
+// packus interleaves its inputs within 128 bit lanes, quantizeOutput() lays the weights out to match
+template<typename Arch>
+inline nativeVector activate8(nativeVector v){
+	const nativeVector clamped = min_epi16(set1_epi16(Arch::QA), max_epi16(v, set1_epi16(0)));
+	// mulhrs is (a * b + (1 << 14)) >> 15, so this is v * v >> OUTPUT8_SHIFT rounded
+	return mulhrs_epi16(clamped, slli_epi16(clamped, 15 - OUTPUT8_SHIFT));
+}
+template<typename Arch>
+int32_t outputSCReLU8(const int16_t *STM, const int16_t *OPP, const int8_t *weights){
+	const int8_t *nstmWeights = weights + Arch::HIDDEN;
+	nativeVector stmSum = set1_epi16(0);
+	nativeVector nstmSum = set1_epi16(0);
+	for (size_t i=0;i<Arch::HIDDEN;i+=2*I16_VECTOR_SIZE){
+		const nativeVector stmPacked  = packus_epi16(activate8<Arch>(loadRow(STM, i)), activate8<Arch>(loadRow(STM, i + I16_VECTOR_SIZE)));
+		const nativeVector nstmPacked = packus_epi16(activate8<Arch>(loadRow(OPP, i)), activate8<Arch>(loadRow(OPP, i + I16_VECTOR_SIZE)));
+		stmSum = dpbusd_epi32(stmSum, stmPacked, load_epi16(reinterpret_cast<const nativeVector*>(&weights[i])));
+		nstmSum = dpbusd_epi32(nstmSum, nstmPacked, load_epi16(reinterpret_cast<const nativeVector*>(&nstmWeights[i])));
+	}
+	return reduce_epi32(add_epi32(stmSum, nstmSum));
+}
+
+// Deep nets, the accumulator squared down to uint8 the same way, packed in the same order
+template<typename Arch>
+void activateSparse(const int16_t *in, uint8_t *out){
+	for (size_t i=0;i<Arch::HIDDEN;i+=2*I16_VECTOR_SIZE){
+		const nativeVector packed = packus_epi16(activate8<Arch>(loadRow(in, i)), activate8<Arch>(loadRow(in, i + I16_VECTOR_SIZE)));
+		store_epi16(reinterpret_cast<nativeVector*>(&out[i]), packed);
+	}
+}
+// Indices of the blocks of 4 activations that aren't all zero, of which there are usually few
+template<typename Arch>
+int findNonZero(const uint8_t *in, uint16_t *indices){
+	int count = 0;
+	for (size_t i=0;i<2*Arch::HIDDEN;i+=sizeof(nativeVector)){
+		uint32_t mask = nonZeroMask(load_epi16(reinterpret_cast<const nativeVector*>(&in[i])));
+		while (mask){
+			indices[count++] = i / 4 + std::countr_zero(mask);
+			mask &= mask - 1;
+		}
+	}
+	return count;
+}
+// L1 over just those blocks, each is broadcast and multiplied against every output's 4 weights at once
+template<typename Arch>
+void sparseL1(const uint8_t *in, const uint16_t *indices, int count, const int8_t *weights, int32_t *out){
+	constexpr size_t REGS = Arch::L1 * 4 / sizeof(nativeVector);
+	static_assert(Arch::L1 * 4 % sizeof(nativeVector) == 0);
+	// Not std::array, vector types lose their attributes as template arguments (-Wignored-attributes)
+	nativeVector sums[REGS];
+	for (nativeVector &sum : sums)
+		sum = set1_epi16(0);
+	for (int k=0;k<count;k++){
+		int32_t block;
+		std::memcpy(&block, &in[indices[k] * 4], sizeof(block));
+		const nativeVector v = set1_epi32(block);
+		const nativeVector *w = reinterpret_cast<const nativeVector*>(&weights[indices[k] * Arch::L1 * 4]);
+		for (size_t r=0;r<REGS;r++)
+			sums[r] = dpbusd_epi32(sums[r], v, load_epi16(&w[r]));
+	}
+	for (size_t r=0;r<REGS;r++)
+		store_epi16(reinterpret_cast<nativeVector*>(&out[r * sizeof(nativeVector) / 4]), sums[r]);
+}
+
+template<typename Arch>
+constexpr NNUEKernels kernels = {KERNEL_NAME, I16_VECTOR_SIZE, addRow<Arch>, subRow<Arch>, addSub<Arch>, addSubSub<Arch>,
+	addAddSubSub<Arch>, outputSCReLU<Arch>, outputSCReLU8<Arch>, activateSparse<Arch>, findNonZero<Arch>, sparseL1<Arch>};
+
+}
+
+#if defined(__clang__)
+	#pragma clang attribute pop
+#else
+	#pragma GCC pop_options
+#endif
+
+#undef set1_epi16
+#undef load_epi16
+#undef store_epi16
+#undef min_epi16
+#undef max_epi16
+#undef madd_epi16
+#undef mullo_epi16
+#undef add_epi32
+#undef add_epi16
+#undef sub_epi16
+#undef slli_epi16
+#undef mulhrs_epi16
+#undef maddubs_epi16
+#undef packus_epi16
+#undef set1_epi32
+#undef vnni_dpwssd
+#undef vnni_dpbusd
+#undef dpwssd_epi32
+#undef dpbusd_epi32
+#undef KERNEL_PRAGMA
+#undef KERNEL_PRAGMA_
+#undef KERNEL_NAMESPACE
+#undef KERNEL_TARGET
+#undef KERNEL_WIDTH
+#undef KERNEL_NAME
+#undef KERNEL_VNNI
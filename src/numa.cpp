@@ -0,0 +1,107 @@
+#include "numa.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+
+#if defined(__linux__)
+	#include <pthread.h>
+	#include <sched.h>
+	#define NUMA_CAN_BIND
+#endif
+
+namespace Numa {
+
+std::vector<int> parseCpuList(const char *list){
+	std::vector<int> cpus;
+	const char *p = list;
+	while (*p){
+		char *end;
+		long first = std::strtol(p, &end, 10);
+		if (end == p)
+			break;
+		long last = first;
+		p = end;
+		if (*p == '-'){
+			last = std::strtol(p + 1, &end, 10);
+			p = end;
+		}
+		for (long c=first;c<=last;c++)
+			cpus.push_back(c);
+		while (*p == ',' || *p == ' ' || *p == '\n')
+			p++;
+	}
+	return cpus;
+}
+
+#if defined(NUMA_CAN_BIND)
+// Affinity at startup, so taskset and the like are respected and bind(-1) can go back to it
+static const cpu_set_t &startAffinity(){
+	static const cpu_set_t set = []{
+		cpu_set_t s;
+		CPU_ZERO(&s);
+		if (sched_getaffinity(0, sizeof(s), &s) != 0)
+			for (int c=0;c<CPU_SETSIZE;c++)
+				CPU_SET(c, &s);
+		return s;
+	}();
+	return set;
+}
+#endif
+
+static std::vector<std::vector<int>> readNodes(){
+	std::vector<std::vector<int>> found;
+	#if defined(NUMA_CAN_BIND)
+		// Node numbers can have holes, stop after a run of missing ones
+		for (int n=0, missing=0;missing<64;n++){
+			std::ifstream in("/sys/devices/system/node/node" + std::to_string(n) + "/cpulist");
+			if (!in){
+				missing++;
+				continue;
+			}
+			missing = 0;
+			std::string line;
+			std::getline(in, line);
+			std::vector<int> cpus;
+			for (int c : parseCpuList(line.c_str()))
+				if (c < CPU_SETSIZE && CPU_ISSET(c, &startAffinity()))
+					cpus.push_back(c);
+			// Memory only nodes, or ones taskset keeps us off
+			if (!cpus.empty())
+				found.push_back(cpus);
+		}
+	#endif
+	return found;
+}
+
+const std::vector<std::vector<int>> &nodes(){
+	static const std::vector<std::vector<int>> topology = readNodes();
+	return topology;
+}
+
+int nodeCount(){
+	return std::max<int>(1, nodes().size());
+}
+
+int nodeOf(int idx){
+	return idx % nodeCount();
+}
+
+void bind(int node){
+	if (nodes().size() < 2)
+		return;
+	#if defined(NUMA_CAN_BIND)
+		cpu_set_t set;
+		if (node < 0)
+			set = startAffinity();
+		else {
+			CPU_ZERO(&set);
+			for (int c : nodes()[node % nodes().size()])
+				CPU_SET(c, &set);
+		}
+		pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	#endif
+}
+
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <vector>
+
+// NUMA topology straight from /sys/devices/system/node, so no libnuma needed
+// Anything else (other OSes, a single node, no /sys) is treated as one node and never pinned
+namespace Numa {
+	// CPUs of each node we're allowed to run on, nodes with none of them left out
+	const std::vector<std::vector<int>> &nodes();
+	int nodeCount();
+	// Node search thread idx (0 is the main thread) goes on, round robin so every node gets some
+	int nodeOf(int idx);
+	// Pins the calling thread to node's CPUs, a negative node undoes it
+	void bind(int node);
+	// "0-3,8,10-11" -> {0,1,2,3,8,10,11}
+	std::vector<int> parseCpuList(const char *list);
+}
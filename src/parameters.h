@@ -2,6 +2,8 @@
 
 #define MAX_PLY 125
 #define BENCH_DEPTH 12
+// Nodes between clock reads in the search, ~1ms at 1M nps
+constexpr uint64_t TIME_CHECK_NODES = 1024;
 // History
 constexpr int16_t MAX_HISTORY = 16383;
 const int16_t DEFAULT_HISTORY = 0;
@@ -22,6 +24,9 @@ constexpr int NMP_EVAL_SCALE = 200;
 
 constexpr int SEE_ORDERING_MARGIN = -100;
 
+// How far outside the window the small net's eval has to be for qsearch to stand pat on it
+constexpr int SMALL_NET_MARGIN = 400;
+
 constexpr int SE_MIN_DEPTH = 8;
 constexpr int SE_BETA_SCALE = 32;
 constexpr int SE_DOUBLE_MARGIN = 20;
@@ -41,6 +46,9 @@ constexpr int IIR_MIN_DEPTH = 6;
 
 constexpr int LMP_MIN_MOVES_BASE = 2;
 
+// Shallowest node ABDADA marks its moves busy and defers ones other threads are on
+constexpr int ABDADA_MIN_DEPTH = 3;
+
 constexpr int MIN_ASP_WINDOW_DEPTH = 6;
 constexpr int INITIAL_ASP_WINDOW = 40; 
 constexpr int ASP_WIDENING_FACTOR = 3;
\ No newline at end of file
@@ -4,6 +4,8 @@
 #include "tt.h"
 #include "util.h"
 #include "parameters.h"
+#include "movepicker.h"
+#include "numa.h"
 
 #include <algorithm>
 #include <random>
@@ -17,6 +19,12 @@ using namespace chess;
 namespace Search {
 	std::array<std::array<std::array<int, 219>, MAX_PLY + 1>, 2> lmrTable;
 
+	// Depths helper threads skip, so they aren't all on the same iteration as the main thread
+	// Helper i skips blocks of SKIP_SIZE[i] depths every other block, starting SKIP_PHASE[i] in (Stockfish's old scheme)
+	constexpr int SKIP_PATTERNS = 20;
+	constexpr std::array<int, SKIP_PATTERNS> SKIP_SIZE  = {1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 4, 4, 4, 4, 4, 4, 4, 4};
+	constexpr std::array<int, SKIP_PATTERNS> SKIP_PHASE = {0, 1, 0, 1, 2, 3, 0, 1, 2, 3, 4, 5, 0, 1, 2, 3, 4, 5, 6, 7};
+
 	bool isWin(int score){
 		return score >= FOUND_MATE;
 	}
@@ -50,55 +58,59 @@ namespace Search {
 			}
 		}
 	}
-	int scoreMove(Move &move, Move &ttMove, Stack *ss, ThreadInfo &thread){
-		// MVV-LVA
-		// TT Move
-		// Killer Move Heuristic
-		// Butterfly History Heuristic
-
-		PieceType to = thread.board.at<PieceType>(move.to());
-		if (move == ttMove){
-			return 1000000;
-		}
-		else if (to != PieceType::NONE) {
-			int hist = thread.getCapthist(thread.board, move);
-			int score = hist + MVV_VALUES[to];
-			return 500000 + score;
+	bool useSmallNet = false;
+
+	// Raw network eval, going through the shared eval cache first
+	// A hit also saves bringing the accumulator up to date
+	// Given a window, the small net gets a go before the main one. Its eval is returned when it's so far outside
+	// the window that the exact value wouldn't change anything, and isn't cached since it's only a rough guess
+	int evaluate(ThreadInfo &thread, const int alpha = -INFINITE, const int beta = INFINITE){
+		const uint64_t key = thread.board.hash();
+		int eval;
+		thread.evalProbes++;
+		if (thread.TT.evals.probe(key, eval)){
+			thread.evalHits++;
+			return eval;
 		}
-		else if (move == ss->killer){
-			return 400000;
-		}
-		else {
-			// Quiet non killers
-			// main history + continuation history ~10 1ply
-			return thread.getQuietHistory(thread.board, move, ss);
+		if (useSmallNet && beta != INFINITE){
+			eval = smallNetwork.inference(&thread.board, thread.smallAccumulators);
+			if (eval >= beta + SMALL_NET_MARGIN || eval <= alpha - SMALL_NET_MARGIN){
+				thread.smallEvals++;
+				return eval;
+			}
 		}
-		return -1000000;
+		eval = thread.net->inference(&thread.board, thread.accumulators);
+		thread.TT.evals.store(key, eval);
+		return eval;
 	}
-	bool scoreComparator(Move &a, Move &b){
-		return a.score() > b.score();
+	// Hard limits, checked before every move
+	// The node limit is a compare and stays exact, the clock is only read every TIME_CHECK_NODES nodes
+	// Helpers only publish their nodes, the main thread keeps the limits and aborts for everyone
+	bool outOfLimits(ThreadInfo &thread, Limit &limit){
+		const bool helper = thread.threadIdx > 0;
+		if (!helper && limit.outOfNodes(thread.nodes))
+			return true;
+		if (thread.nodes < thread.nextTimeCheck)
+			return false;
+		thread.nextTimeCheck = thread.nodes + TIME_CHECK_NODES;
+		thread.publishNodes();
+		return !helper && limit.outOfTime();
 	}
-	void pickMove(Movelist &mvlst, int start){
-		for (int i=start+1;i<mvlst.size();i++){
-			if (mvlst[i].score() > mvlst[start].score()){
-				std::iter_swap(mvlst.begin() + start, mvlst.begin() + i);
-			}
-		}
-	}	
 	template<bool isPV>
 	int qsearch(int ply, int alpha, const int beta, Stack *ss, ThreadInfo &thread, Limit &limit){
 		//bool isPV = alpha != beta - 1;
-		TTEntry *ttEntry = thread.TT.getEntry(thread.board.hash());
-		bool ttHit = ttEntry->zobrist == thread.board.hash();
+		TTEntry ttEntry;
+		bool ttHit = thread.TT.probe(thread.board.hash(), ttEntry);
 		if (!isPV && ttHit
-			&& (ttEntry->flag == TTFlag::EXACT 
-				|| (ttEntry->flag == TTFlag::BETA_CUT && ttEntry->score >= beta)
-				|| (ttEntry->flag == TTFlag::FAIL_LOW && ttEntry->score <= alpha))){
+			&& (ttEntry.flag() == TTFlag::EXACT 
+				|| (ttEntry.flag() == TTFlag::BETA_CUT && ttEntry.score >= beta)
+				|| (ttEntry.flag() == TTFlag::FAIL_LOW && ttEntry.score <= alpha))){
 			//thread.ttHits ++;
-			return ttEntry->score;
+			return ttEntry.score;
 		}
+		Move ttMove = ttEntry.getMove();
 
-		int score = network.inference(&thread.board, thread.accumulator);
+		int score = evaluate(thread, alpha, beta);
 		if (ply >= MAX_PLY)
 			return score;
 		// if (isPV)
@@ -113,37 +125,28 @@ namespace Search {
 		int moveCount = 0;
 		bool inCheck = thread.board.inCheck();
 
-		Movelist moves;
-		movegen::legalmoves<movegen::MoveGenType::CAPTURE>(moves, thread.board);
-
-		// Move Scoring
-		for (auto &move : moves){
-			// Qsearch doesnt have killers
-			// Still pass to make compiler happy
-			move.setScore(scoreMove(move, ttEntry->move, ss, thread));
-		}
-		for (int m_ = 0;m_<moves.size();m_++){
+		MovePicker picker(thread, ss, ttMove, true);
+		for (Move move = picker.next();!moveIsNull(move);move = picker.next()){
 			if (thread.abort.load(std::memory_order_relaxed))
 				return bestScore;
-			if (limit.outOfTime() || limit.outOfNodes(thread.nodes)){
+			if (outOfLimits(thread, limit)){
 				thread.abort.store(true, std::memory_order_relaxed);
 				return bestScore;
 			}
-			
-			// Move ordering
-			pickMove(moves, m_);
-			Move move = moves[m_];
 
 			// SEE Pruning
 			if (bestScore > GETTING_MATED && !SEE(thread.board, move, 0))
 				continue;
+			if (!picker.isLegal(move))
+				continue;
 
 
-			MakeMove(thread.board, thread.accumulator, move);
+			thread.TT.prefetch(thread.board.hashAfter(move));
+			MakeMove(thread.board, thread.accumulators, thread.smallAccumulators, move);
 			thread.nodes++;
 			moveCount++;
 			score = -qsearch<isPV>(ply+1, -beta, -alpha, ss+1, thread, limit);
-			UnmakeMove(thread.board, thread.accumulator, move);
+			UnmakeMove(thread.board, thread.accumulators, thread.smallAccumulators, move);
 
 			if (score > bestScore){
 				bestScore = score;
@@ -177,15 +180,16 @@ namespace Search {
 		}
 
 
-		TTEntry *ttEntry = thread.TT.getEntry(thread.board.hash());
-		bool ttHit = moveIsNull(ss->excluded) && ttEntry->zobrist == thread.board.hash();
-		if (!isPV && ttHit && ttEntry->depth >= depth
-			&& (ttEntry->flag == TTFlag::EXACT 
-				|| (ttEntry->flag == TTFlag::BETA_CUT && ttEntry->score >= beta)
-				|| (ttEntry->flag == TTFlag::FAIL_LOW && ttEntry->score <= alpha))){
-			return ttEntry->score;
+		TTEntry ttEntry;
+		bool ttHit = thread.TT.probe(thread.board.hash(), ttEntry) && moveIsNull(ss->excluded);
+		if (!isPV && ttHit && ttEntry.depth >= depth
+			&& (ttEntry.flag() == TTFlag::EXACT 
+				|| (ttEntry.flag() == TTFlag::BETA_CUT && ttEntry.score >= beta)
+				|| (ttEntry.flag() == TTFlag::FAIL_LOW && ttEntry.score <= alpha))){
+			return ttEntry.score;
 		}
-		bool hashMove = !ttHit || moveIsNull(ttEntry->move);
+		Move ttMove = ttEntry.getMove();
+		bool hashMove = !ttHit || moveIsNull(ttMove);
 
 		// http://talkchess.com/forum3/viewtopic.php?f=7&t=74769&sid=64085e3396554f0fba414404445b3120
     	// https://github.com/jhonnold/berserk/blob/dd1678c278412898561d40a31a7bd08d49565636/src/search.c#L379
@@ -198,7 +202,7 @@ namespace Search {
 		bool inCheck = thread.board.inCheck();
 
 		if (!inCheck){
-			ss->staticEval = network.inference(&thread.board, thread.accumulator);;
+			ss->staticEval = evaluate(thread);
 		}
 		else {
 			ss->staticEval = -INFINITE;
@@ -254,35 +258,51 @@ namespace Search {
 
 
 		Move bestMove = Move::NO_MOVE;
-		Movelist moves;
 		Movelist seenQuiets;
 		Movelist seenCaptures;
 
-		movegen::legalmoves(moves, thread.board);
-
-		// Move Scoring
-		for (auto &move : moves){
-			move.setScore(scoreMove(move, ttEntry->move, ss, thread));
-		}
-		if (root)
-			bestMove = moves[0]; // Guaruntee some random move
+		MovePicker picker(thread, ss, ttMove, false);
+		// ABDADA: moves whose child another thread is searching wait until the picker runs dry
+		const bool abdada = thread.abdada && depth >= ABDADA_MIN_DEPTH;
+		Movelist deferred;
+		int deferredIdx = 0;
+		bool pickerDone = false;
+		auto nextMove = [&]() -> Move {
+			if (!pickerDone){
+				const Move m = picker.next();
+				if (!moveIsNull(m))
+					return m;
+				pickerDone = true;
+			}
+			return deferredIdx < deferred.size() ? deferred[deferredIdx++] : Move(Move::NO_MOVE);
+		};
 		// Other vars
 		bool skipQuiets = false;
-		for (int m_ = 0;m_<moves.size();m_++){
+		for (Move move = nextMove();!moveIsNull(move);move = nextMove()){
+			// Deferred moves come after everything else, so nothing is left to defer behind
+			const bool revisit = deferredIdx > 0;
 			if (thread.abort.load(std::memory_order_relaxed))
 				return bestScore;
-			if ( (limit.outOfTime() || limit.outOfNodes(thread.nodes)) && thread.rootDepth != 1 ){
+			if (thread.rootDepth != 1 && outOfLimits(thread, limit)){
 				thread.abort.store(true, std::memory_order_relaxed);
 				return bestScore;
 			}
-			pickMove(moves, m_);
-			Move move = moves[m_];
 			bool isQuiet = thread.board.at<PieceType>(move.to()) == PieceType::NONE;
 
 			if (move == ss->excluded)
 				continue;
 			if (isQuiet && skipQuiets)
 				continue;
+			// Only pseudo legal up to here, moves skipped above never pay for the check
+			if (!picker.isLegal(move))
+				continue;
+			if (root && moveIsNull(bestMove))
+				bestMove = move; // Guaruntee some random move
+			// Never the first move, something has to give us a score to work with
+			if (abdada && !revisit && moveCount > 0 && thread.TT.busy.busy(thread.board.hashAfter(move))){
+				deferred.add(move);
+				continue;
+			}
 			if (isQuiet)
 				seenQuiets.add(move);
 			else
@@ -292,8 +312,11 @@ namespace Search {
 
 			if (!root && bestScore > GETTING_MATED){
 				// Late Move Pruning
-				if (!isPV && !inCheck && moveCount >= LMP_MIN_MOVES_BASE + depth * depth / (2 - improving))
-					break;
+				// Deferred moves were ordered before this one, so they still get searched
+				if (!revisit && !isPV && !inCheck && moveCount >= LMP_MIN_MOVES_BASE + depth * depth / (2 - improving)){
+					pickerDone = true;
+					continue;
+				}
 
 				// History Pruning
 				// https://github.com/aronpetko/integral/blob/733036df88408d0d6338d05f7991f46f0527ed4f/src/engine/search/search.cc#L945
@@ -311,16 +334,16 @@ namespace Search {
 			// Sirius conditions
 			// https://github.com/mcthouacbb/Sirius/blob/15501c19650f53f0a10973695a6d284bc243bf7d/Sirius/src/search.cpp#L620
 			bool doSE = !root && moveIsNull(ss->excluded) &&
-						depth >= SE_MIN_DEPTH && ttEntry->move == move && ttEntry->depth >= depth - 3
-						&& ttEntry->flag != TTFlag::FAIL_LOW && !isMateScore(ttEntry->score);	
+						depth >= SE_MIN_DEPTH && ttMove == move && ttEntry.depth >= depth - 3
+						&& ttEntry.flag() != TTFlag::FAIL_LOW && !isMateScore(ttEntry.score);	
 			
 			int extension = 0;
 
 			if (doSE) {
-				int sBeta = std::max(-MATE, ttEntry->score - SE_BETA_SCALE * depth / 16);
+				int sBeta = std::max(-MATE, ttEntry.score - SE_BETA_SCALE * depth / 16);
 				int sDepth = (depth - 1) / 2;
 				// How good are we without this move
-				ss->excluded = ttEntry->move;
+				ss->excluded = ttMove;
 				int seScore = search<false>(sDepth, ply+1, sBeta-1, sBeta, ss, thread, limit);
 				ss->excluded = Move::NO_MOVE;
 
@@ -330,12 +353,17 @@ namespace Search {
 					else
 						extension = 1; // Singular Extension
 				}
-				else if (ttEntry->score >= beta)
+				else if (ttEntry.score >= beta)
 					extension = -2 + isPV;
 
 			}					
 
-			MakeMove(thread.board, thread.accumulator, move);
+			// Only an estimate, but the busy check above uses the same one
+			const uint64_t childKey = thread.board.hashAfter(move);
+			thread.TT.prefetch(childKey);
+			MakeMove(thread.board, thread.accumulators, thread.smallAccumulators, move);
+			if (abdada)
+				thread.TT.busy.mark(childKey);
 
 			moveCount++;
 			thread.nodes++;
@@ -357,7 +385,9 @@ namespace Search {
 			if (isPV && (moveCount == 1 || score > alpha)){
 				score = -search<isPV>(newDepth, ply+1, -beta, -alpha, ss+1, thread, limit);
 			}
-			UnmakeMove(thread.board, thread.accumulator, move);
+			if (abdada)
+				thread.TT.busy.unmark(childKey);
+			UnmakeMove(thread.board, thread.accumulators, thread.smallAccumulators, move);
 			if (score > bestScore){
 				bestScore = score;
 				if (score > alpha){
@@ -409,17 +439,40 @@ namespace Search {
 			return inCheck ? -MATE + ply : 0;
 
 		if (moveIsNull(ss->excluded)){
-			*ttEntry = TTEntry(thread.board.hash(), ttFlag == TTFlag::FAIL_LOW ? ttEntry->move : bestMove, bestScore, ttFlag, depth);
+			thread.TT.store(thread.board.hash(), ttFlag == TTFlag::FAIL_LOW ? ttMove : bestMove, bestScore, ss->staticEval, ttFlag, depth);
 		}
 		return bestScore;
 
 	}
 
+	void printInfo(int depth, int score, const PVList &pv, uint64_t nodes, int64_t ms){
+		std::cout << "info depth " << depth << " score ";
+		if (score >= FOUND_MATE || score <= GETTING_MATED){
+			std::cout << "mate " << ((score < 0) ? "-" : "") << (MATE - std::abs(score)) / 2 + 1;
+		}
+		else
+			std::cout << "cp " << score;
+
+		std::cout << " nodes " << nodes << " nps " << nodes / (ms+1) * 1000 << " pv ";
+		for (int i=0;i<pv.length;i++)
+			std::cout << uci::moveToUci(pv.moves[i]) << " ";
+		std::cout << std::endl;
+	}
+
 	int iterativeDeepening(Board &board, ThreadInfo &threadInfo, Limit limit, Searcher *searcher){
 		//limit.start();
-		threadInfo.abort.store(false);
+		// With a searcher, start clears abort before any thread runs. Clearing it here could undo a main thread that's already done
+		if (searcher == nullptr)
+			threadInfo.abort.store(false);
 		threadInfo.board = board;
-		threadInfo.accumulator.refresh(threadInfo.board);
+		// Room for the deepest line (null moves included) so make/unmake never allocate mid search
+		threadInfo.board.reserveHistory(MAX_PLY + 1);
+		threadInfo.accumulators.reset(*threadInfo.net, threadInfo.board);
+		if (useSmallNet)
+			threadInfo.smallAccumulators.reset(smallNetwork, threadInfo.board);
+		threadInfo.evalProbes = 0;
+		threadInfo.evalHits = 0;
+		threadInfo.smallEvals = 0;
 
 		// TODO set nodes and stuff too
 		bool isMain = threadInfo.type == ThreadType::MAIN;
@@ -444,6 +497,13 @@ namespace Search {
 				else
 					return limit.softNodes(threadInfo.nodes) || threadInfo.abort.load(std::memory_order_relaxed);
 			};
+			// Helpers never skip depth 1, so they always have a move for the vote
+			// ABDADA keeps everyone on the same depth, deferring moves splits the work instead
+			if (!threadInfo.abdada && threadInfo.threadIdx > 0 && depth > 1){
+				const int i = (threadInfo.threadIdx - 1) % SKIP_PATTERNS;
+				if ((depth + SKIP_PHASE[i]) / SKIP_SIZE[i] % 2)
+					continue;
+			}
 			threadInfo.rootDepth = depth;
 			// Aspiration Windows (WIP)
 			if (depth >= MIN_ASP_WINDOW_DEPTH){
@@ -474,12 +534,28 @@ namespace Search {
 			// ---------------------
 			//std::cout << "Depth " << depth << " Nodes " << threadInfo.nodes << " Hard " << limit.outOfNodes(threadInfo.nodes) << " soft " << limit.softNodes(threadInfo.nodes) << std::endl;
 			//std::cout << threadInfo.board.getFen() << std::endl;
-			if (depth != 1 && aborted()){
+			const bool cut = aborted();
+			if (depth != 1 && cut){
 				break;
 			}
 
 			lastScore = score;
 			lastPV = ss->pv;
+			// A depth 1 the abort cut short has no real score or PV, a helper's sits out the vote
+			// The main thread keeps it if it's all there is, it still has to say something
+			if (!cut || (isMain && threadInfo.completedDepth == 0)){
+				threadInfo.completedDepth = depth;
+				threadInfo.completedScore = score;
+				threadInfo.completedPV = lastPV;
+				// Stopped before depth 1 found anything, any legal move beats none
+				if (threadInfo.completedPV.length == 0){
+					Movelist moves;
+					movegen::legalmoves(moves, threadInfo.board);
+					if (!moves.empty())
+						threadInfo.completedPV.update(moves[0], PVList());
+				}
+			}
+			threadInfo.publishNodes();
 
 			// Maybe useful info for diagnostics
 			if (oldnodecnt != 0){
@@ -498,30 +574,37 @@ namespace Search {
 			
 			// MakeMove(threadInfo.board, threadInfo.accumulator, lastPV.moves[0]);
 			// moveEval = network.inference(&threadInfo.board, &threadInfo.accumulator);
-			std::cout << "info depth " << depth << " score ";
-			if (score >= FOUND_MATE || score <= GETTING_MATED){
-				std::cout << "mate " << ((score < 0) ? "-" : "") << (MATE - std::abs(score)) / 2 + 1;
-			}
-			else
-				std::cout << "cp " << score;
-
-			std::cout << " nodes " << nodecnt << " nps " << nodecnt / (limit.timer.elapsed()+1) * 1000 << " pv ";
+			printInfo(depth, score, lastPV, nodecnt, limit.timer.elapsed());
 			//UnmakeMove(threadInfo.board, threadInfo.accumulator, lastPV.moves[0]);
-			for (int i=0;i<lastPV.length;i++)
-				std::cout << uci::moveToUci(lastPV.moves[i]) << " ";
-			std::cout << std::endl;
 
 			if (limit.outOfTimeSoft())
 				break;
 
 		}
 		
+		// A helper can get to limit.depth first since it skips depths, it mustn't cut the main thread's last iteration short
+		if (threadInfo.threadIdx == 0)
+			threadInfo.abort.store(true, std::memory_order_relaxed);
+		threadInfo.publishNodes();
+
 		if (isMain){
-			std::cout << "bestmove " << uci::moveToUci(lastPV.moves[0]) << std::endl;
+			// Helpers stop on the abort, then every thread's last iteration gets a say in the move
+			ThreadInfo *best = &threadInfo;
+			if (searcher != nullptr && searcher->threadCount() > 1){
+				searcher->waitForWorkers();
+				best = &searcher->bestThread();
+				if (best != &threadInfo)
+					printInfo(best->completedDepth, best->completedScore, best->completedPV, searcher->nodeCount(), limit.timer.elapsed());
+			}
+			std::cout << "info string eval cache hits " << threadInfo.evalHits << " of " << threadInfo.evalProbes << " ("
+				<< 100 * threadInfo.evalHits / std::max<uint64_t>(1, threadInfo.evalProbes) << "%)" << std::endl;
+			if (useSmallNet)
+				std::cout << "info string small net evals " << threadInfo.smallEvals << std::endl;
+			const Move bestMove = best->completedPV.first();
+			std::cout << "bestmove " << (moveIsNull(bestMove) ? "0000" : uci::moveToUci(bestMove)) << std::endl;
 		}
-		threadInfo.abort.store(true, std::memory_order_relaxed);
 
-		threadInfo.bestMove = lastPV.moves[0];
+		threadInfo.bestMove = lastPV.first();
 		//std::cout << "PRE EVAL ITER DEEP " << threadInfo.bestMove << std::endl;
 		// MakeMove(threadInfo.board, threadInfo.accumulator, lastPV.moves[0]);
 		// moveEval = network.inference(&threadInfo.board, &threadInfo.accumulator);
@@ -529,14 +612,8 @@ namespace Search {
 		return lastScore;
 	}
 
-	// Benchmark for OpenBench
-	void bench(){
-	    int64_t totalNodes = 0;
-	    int64_t totalMS = 0;
-
-	    std::cout << "Benchmark started at depth " << (int)BENCH_DEPTH << std::endl;
-	    // Thanks Prelude
-	    std::array<std::string, 50> fens = {"r3k2r/2pb1ppp/2pp1q2/p7/1nP1B3/1P2P3/P2N1PPP/R2QK2R w KQkq a6 0 14",
+	// Thanks Prelude
+	const std::array<std::string, 50> benchFens = {"r3k2r/2pb1ppp/2pp1q2/p7/1nP1B3/1P2P3/P2N1PPP/R2QK2R w KQkq a6 0 14",
 	                              "4rrk1/2p1b1p1/p1p3q1/4p3/2P2n1p/1P1NR2P/PB3PP1/3R1QK1 b - - 2 24",
 	                              "r3qbrk/6p1/2b2pPp/p3pP1Q/PpPpP2P/3P1B2/2PB3K/R5R1 w - - 16 42",
 	                              "6k1/1R3p2/6p1/2Bp3p/3P2q1/P7/1P2rQ1K/5R2 b - - 4 44",
@@ -587,9 +664,19 @@ namespace Search {
 	                              "3br1k1/p1pn3p/1p3n2/5pNq/2P1p3/1PN3PP/P2Q1PB1/4R1K1 w - - 0 23",
 	                              "2r2b2/5p2/5k2/p1r1pP2/P2pB3/1P3P2/K1P3R1/7R w - - 23 93"};
 
+	// Benchmark for OpenBench
+	void bench(){
+	    int64_t totalNodes = 0;
+	    int64_t totalMS = 0;
+	    uint64_t evalProbes = 0;
+	    uint64_t evalHits = 0;
+	    uint64_t smallEvals = 0;
+
+	    std::cout << "Benchmark started at depth " << (int)BENCH_DEPTH << std::endl;
+
 	    TimeLimit timer = TimeLimit();
 
-	    for (auto fen : fens){
+	    for (auto fen : benchFens){
 	        timer.start();
 	        Board board(fen);
 	        std::atomic<bool> benchAbort(false);
@@ -605,6 +692,9 @@ namespace Search {
 	        int ms = timer.elapsed();
 	        totalMS += ms;
 	        totalNodes += thread->nodes;
+	        evalProbes += thread->evalProbes;
+	        evalHits += thread->evalHits;
+	        smallEvals += thread->smallEvals;
 	        
 	        std::cout << "-----------------------------------------------------------------------" << std::endl;
 	        std::cout << "FEN: " << fen << std::endl;
@@ -617,37 +707,138 @@ namespace Search {
 	    std::cout << "Elapsed Time: " << totalMS << "ms" << std::endl;
 	    int nps = static_cast<int64_t>((totalNodes / totalMS) * 1000);
 	    std::cout << "Average NPS: " << nps << std::endl;
+	    std::cout << "Eval cache hits: " << evalHits << " of " << evalProbes << " (" << 100.0 * evalHits / std::max<uint64_t>(1, evalProbes) << "%)" << std::endl;
+	    if (useSmallNet)
+	        std::cout << "Small net evals: " << smallEvals << " of " << evalProbes << std::endl;
 	    std::cout << totalNodes << " nodes " << nps << " nps" << std::endl;
 	}
 }
 
 void Searcher::start(Board &board, Search::Limit limit){
-	mainInfo->nodes = 0;
-	mainThread = std::thread(Search::iterativeDeepening, std::ref(board), std::ref(*mainInfo), limit, this);
-	for (int i=0;i<workerInfo.size();i++){	
-		workerInfo[i].nodes = 0;
-		workers.emplace_back(Search::iterativeDeepening, std::ref(board), std::ref(workerInfo[i]), limit, nullptr);
+	TT.newSearch();
+	abort.store(false);
+	updateReplicas();
+	// Everything the vote reads is reset before any thread runs, so it only ever sees this search
+	for (int i=0;i<threadCount();i++){
+		Search::ThreadInfo &t = info(i);
+		t.resetNodes();
+		t.completedDepth = 0;
+		t.completedScore = -INFINITE;
+		t.completedPV.length = 0;
+		t.net = replicas.empty() ? &network : replicas[Numa::nodeOf(i)].get();
+		t.abdada = parallelMode == Search::ParallelMode::ABDADA && threadCount() > 1;
+	}
+	// Helpers get their jobs first, so when the main thread is done waitForWorkers really waits for all of them
+	for (int i=threadCount()-1;i>=0;i--){
+		Search::ThreadInfo &t = info(i);
+		thread(i).run([this, &board, limit, &t]{ Search::iterativeDeepening(board, t, limit, this); });
 	}
 }
 
 void Searcher::stop(){
 	abort.store(true, std::memory_order_relaxed);
-	if (mainThread.joinable())
-		mainThread.join();
-
-	if (workers.size() > 0)
-		for (std::thread &t : workers){
-			if (t.joinable())
-				t.join();
-		}
-	workers.clear();
+	// The threads stay around, just wait for them to park
+	if (mainThread)
+		mainThread->wait();
+	for (std::unique_ptr<SearchThread> &t : workers)
+		t->wait();
 }
 
 void Searcher::initialize(int threads){
-	threads-=1;
+	threads = std::max(threads, 1);
 	stop();
+	if (!mainThread)
+		mainThread = std::make_unique<SearchThread>();
+	workers.resize(threads - 1);
+	for (std::unique_ptr<SearchThread> &w : workers)
+		if (!w)
+			w = std::make_unique<SearchThread>();
+
+	// Every thread pins itself and then builds its own ThreadInfo, so first touch puts the histories on its node
+	// A lone thread gains nothing from pinning and would pile up with other single threaded engines on node 0
+	const bool pin = numaPin && threads > 1;
+	mainInfo.reset();
 	workerInfo.clear();
+	workerInfo.resize(threads - 1);
 	for (int i=0;i<threads;i++){
-		workerInfo.emplace_back(ThreadType::SECONDARY, TT, abort);
+		thread(i).run([this, i, pin]{
+			Numa::bind(pin ? Numa::nodeOf(i) : -1);
+			std::unique_ptr<Search::ThreadInfo> t = std::make_unique<Search::ThreadInfo>(i == 0 ? ThreadType::MAIN : ThreadType::SECONDARY, TT, abort);
+			t->threadIdx = i;
+			if (i == 0)
+				mainInfo = std::move(t);
+			else
+				workerInfo[i - 1] = std::move(t);
+		});
+	}
+	for (int i=0;i<threads;i++)
+		thread(i).wait();
+	// Threads may be on different nodes now
+	replicas.clear();
+}
+
+// Each thread votes for its move with (score - worst score + 14) * depth, so deeper and better searches count for more
+// A thread that found a mate wins outright, and the shortest mate beats the rest (Stockfish's scheme)
+Search::ThreadInfo &Searcher::bestThread(){
+	// Only threads with a finished iteration and a move to show for it take part
+	auto hasVote = [](const Search::ThreadInfo &t){
+		return t.completedDepth > 0 && t.completedPV.length > 0;
+	};
+	int minScore = INFINITE;
+	for (int i=0;i<threadCount();i++)
+		if (hasVote(info(i)))
+			minScore = std::min(minScore, info(i).completedScore);
+
+	std::vector<std::pair<Move, int64_t>> votes;
+	auto votesFor = [&](Move m) -> int64_t& {
+		for (auto &v : votes)
+			if (v.first == m)
+				return v.second;
+		return votes.emplace_back(m, 0).second;
+	};
+	for (int i=0;i<threadCount();i++){
+		Search::ThreadInfo &t = info(i);
+		if (hasVote(t))
+			votesFor(t.completedPV.first()) += int64_t(t.completedScore - minScore + 14) * t.completedDepth;
+	}
+
+	Search::ThreadInfo *best = mainInfo.get();
+	for (int i=1;i<threadCount();i++){
+		Search::ThreadInfo &t = info(i);
+		if (!hasVote(t))
+			continue;
+		if (!hasVote(*best))
+			best = &t;
+		else if (Search::isWin(best->completedScore)){
+			if (t.completedScore > best->completedScore)
+				best = &t;
+		}
+		else if (Search::isWin(t.completedScore)
+			|| (!Search::isLoss(t.completedScore) && votesFor(t.completedPV.first()) > votesFor(best->completedPV.first())))
+			best = &t;
+	}
+	return *best;
+}
+
+void Searcher::updateReplicas(){
+	if (!numaReplicate || !numaPin || threadCount() < 2 || Numa::nodeCount() < 2){
+		replicas.clear();
+		return;
+	}
+	// Thread n is the first one on node n, it makes that node's copy
+	const int nodes = std::min(Numa::nodeCount(), threadCount());
+	replicas.resize(nodes);
+	replicaGenerations.resize(nodes);
+	for (int n=0;n<nodes;n++){
+		if (replicas[n] && replicaGenerations[n] == network.generation && replicas[n]->int8Output == network.int8Output)
+			continue;
+		replicaGenerations[n] = network.generation;
+		thread(n).run([this, n]{
+			if (!replicas[n])
+				replicas[n] = std::make_unique<NNUE>();
+			replicas[n]->replicate(network);
+		});
 	}
+	for (int n=0;n<nodes;n++)
+		thread(n).wait();
 }
\ No newline at end of file
@@ -43,19 +43,33 @@ struct PVList {
 	PVList(){
 		length = 0;
 	}
+	// Only copies the moves in use, like operator=
+	PVList(const PVList &other){
+		*this = other;
+	}
 	void update(chess::Move move, const PVList &who){
 		moves[0] = move;
 		std::copy(who.moves.begin(), who.moves.begin() + who.length, moves.begin() + 1);
 		length = who.length + 1;
 	}
-	auto &operator=(const PVList &other){
+	PVList &operator=(const PVList &other){
 		std::copy(other.moves.begin(), other.moves.begin() + other.length, moves.begin());
 		this->length = other.length;
 		return *this;
 	}
+	// No move for an empty PV, e.g. when the root is mate or stalemate
+	chess::Move first() const {
+		return length ? moves[0] : chess::Move(chess::Move::NO_MOVE);
+	}
 };
 
 
+// How the threads split the work, both share one TTable
+enum class ParallelMode {
+	LAZY_SMP,
+	ABDADA
+};
+
 struct Stack {
     PVList pv;
     chess::Move killer;
@@ -72,9 +86,28 @@ struct ThreadInfo {
 	TTable &TT;
 	std::atomic<bool> &abort;
 	Board board;
-	Accumulator accumulator;
-	std::atomic<uint64_t> nodes;
+	AccumulatorStack accumulators;
+	SmallAccumulatorStack smallAccumulators;
+	// The main net or this thread's NUMA node's copy of it
+	const NNUE *net;
+	// Only ever touched by the thread itself, other threads read publishedNodes
+	uint64_t nodes;
+	// Node count at which the search reads the clock and publishes nodes next
+	uint64_t nextTimeCheck;
+	// Eval cache stats for the current search
+	uint64_t evalProbes;
+	uint64_t evalHits;
+	// Qsearch evals the small net settled
+	uint64_t smallEvals;
 	Move bestMove;
+	// Last completed iteration, for the vote on the best move
+	int completedDepth;
+	int completedScore;
+	PVList completedPV;
+	// 0 for the main thread, helpers stagger their depths by it
+	int threadIdx;
+	// Defer moves other threads are busy with instead of staggering depths, see ParallelMode
+	bool abdada;
 	int minNmpPly;
 	int rootDepth;
 
@@ -83,24 +116,40 @@ struct ThreadInfo {
 	MultiArray<int16_t, 64, 6, 2, 64, 6, 2> conthist;
 	// indexed by [stm][moving pt][cap pt][to]
 	MultiArray<int, 64, 6, 6, 2> capthist;
+
+	// nodes as of the last time check or iteration, for nodeCount
+	// Last and on its own cache line, so reading it from another thread doesn't bounce the fields above
+	alignas(64) std::atomic<uint64_t> publishedNodes;
 	
 	ThreadInfo(ThreadType type, TTable &TT, std::atomic<bool> &abort) : type(type), TT(TT), abort(abort) {
 		abort.store(false, std::memory_order_relaxed);
 		this->board = Board();
+		net = &network;
 		std::memset(&history, 0, sizeof(history));
 		conthist.fill(DEFAULT_HISTORY);
 		capthist.fill((int)DEFAULT_HISTORY);
-		nodes = 0;
+		resetNodes();
+		evalProbes = 0;
+		evalHits = 0;
+		smallEvals = 0;
 		bestMove = Move::NO_MOVE;
+		completedDepth = 0;
+		completedScore = -INFINITE;
+		threadIdx = 0;
+		abdada = false;
 		minNmpPly = 0;
 		rootDepth = 0;
 		//ttHits = 0;
 	}
 	ThreadInfo(const ThreadInfo &other) : type(other.type), TT(other.TT), abort(other.abort), history(other.history), 
-											bestMove(other.bestMove), minNmpPly(other.minNmpPly), rootDepth(other.rootDepth) {
+											bestMove(other.bestMove), completedDepth(other.completedDepth), completedScore(other.completedScore),
+											completedPV(other.completedPV), threadIdx(other.threadIdx), abdada(other.abdada), minNmpPly(other.minNmpPly), rootDepth(other.rootDepth) {
 		this->board = other.board;
+		net = other.net;
 		conthist = other.conthist;
-		nodes.store(other.nodes.load(std::memory_order_relaxed), std::memory_order_relaxed);
+		nodes = other.nodes;
+		nextTimeCheck = other.nextTimeCheck;
+		publishedNodes.store(other.publishedNodes.load(std::memory_order_relaxed), std::memory_order_relaxed);
 	}
 	// History updaters
 	void updateHistory(Color c, Move m, int bonus){
@@ -141,8 +190,16 @@ struct ThreadInfo {
 			hist += getConthist((ss-1)->conthist, board, m);
 		return hist;
 	}
+	void resetNodes(){
+		nodes = 0;
+		nextTimeCheck = 0;
+		publishedNodes.store(0, std::memory_order_relaxed);
+	}
+	void publishNodes(){
+		publishedNodes.store(nodes, std::memory_order_relaxed);
+	}
 	void reset(){
-		nodes.store(0, std::memory_order_relaxed);
+		resetNodes();
 		bestMove = Move::NO_MOVE;
 		for (auto &i : history)
 			for (auto &j : i)
@@ -213,5 +270,9 @@ struct Limit {
 //int iterativeDeepening(Board board, ThreadInfo &threadInfo, Searcher *searcher);
 int iterativeDeepening(Board &board, ThreadInfo &threadInfo, Limit limit, Searcher *searcher);
 
+// Positions bench searches, also handy for anything else that wants a spread of positions
+extern const std::array<std::string, 50> benchFens;
+// Let qsearch stand pat on smallNetwork's eval when it's far outside the window, see the SmallNet option
+extern bool useSmallNet;
 void bench();
 } 
\ No newline at end of file
@@ -3,41 +3,122 @@
 #include "external/chess.hpp"
 #include "tt.h"
 #include "search.h"
+#include "timeman.h"
+#include "threads.h"
+#include <algorithm>
+#include <iostream>
+#include <string>
 #include <atomic>
 #include <vector>
 #include <thread>
+#include <memory>
 
 
 struct Searcher {
 	TTable TT;
 	std::atomic<bool> abort;
-	std::unique_ptr<Search::ThreadInfo> mainInfo = std::make_unique<Search::ThreadInfo>(ThreadType::MAIN, TT, abort);
-	std::thread mainThread;
+	// Created once by initialize and parked between searches
+	// Each ThreadInfo is built by its own thread
+	std::unique_ptr<Search::ThreadInfo> mainInfo;
+	std::unique_ptr<SearchThread> mainThread;
 
-	std::vector<Search::ThreadInfo> workerInfo;
-	std::vector<std::thread> workers;
+	std::vector<std::unique_ptr<Search::ThreadInfo>> workerInfo;
+	std::vector<std::unique_ptr<SearchThread>> workers;
+
+	// Lazy SMP or ABDADA, only matters with more than one thread
+	Search::ParallelMode parallelMode = Search::ParallelMode::LAZY_SMP;
+	// Pin threads to NUMA nodes, only takes effect with more than one node and thread
+	bool numaPin = true;
+	// Give every node the threads are on its own copy of the net, needs numaPin
+	bool numaReplicate = false;
+	// Per node copies of network, and the network.generation each was made from
+	std::vector<std::unique_ptr<NNUE>> replicas;
+	std::vector<uint64_t> replicaGenerations;
 
 	void start(Board &board, Search::Limit limit);
 	void stop();
 
 	void initialize(int threads);
+	// Makes any missing or out of date network copies, on the threads of their nodes
+	void updateReplicas();
+	// Called by the main search thread once it's done, waits for the helpers to see the abort
+	void waitForWorkers(){
+		for (std::unique_ptr<SearchThread> &w : workers)
+			w->wait();
+	}
+	// Thread whose move wins the vote, see search.cpp
+	Search::ThreadInfo &bestThread();
+
+	// 0 is the main thread
+	SearchThread &thread(int idx){
+		return idx == 0 ? *mainThread : *workers[idx - 1];
+	}
+	Search::ThreadInfo &info(int idx){
+		return idx == 0 ? *mainInfo : *workerInfo[idx - 1];
+	}
 
-	void resizeTT(uint64_t size){
-		TT.resize(size);
-		TT.clear();
+	int threadCount(){
+		return workerInfo.size() + 1;
+	}
+	// False if size couldn't be allocated and the table fell back to a smaller one
+	bool resizeTT(uint64_t size){
+		TimeLimit timer;
+		timer.start();
+		const bool resized = TT.resize(size);
+		if (resized)
+			std::cout << "info string Hash allocated " << size << " MB" << (TT.hugePages ? " with" : " without") << " huge pages in " << timer.elapsed() << " ms" << std::endl;
+		else
+			std::cout << "info string Could not allocate " << size << " MB of Hash, using " << TT.size * sizeof(TTBucket) / (1024 * 1024) << " MB" << std::endl;
+		clearTT();
+		return resized;
+	}
+	// The pooled threads each clear a slice, so with NumaPin their part of the table is on their node
+	void clearTT(){
+		TimeLimit timer;
+		timer.start();
+		if (!mainThread)
+			TT.clear();
+		else {
+			// A running search would be writing into the table as it's zeroed
+			stop();
+			const int slices = threadCount();
+			for (int i=0;i<slices;i++)
+				thread(i).run([this, i, slices]{ TT.clearSlice(i, slices); });
+			TT.clearCaches();
+			for (int i=0;i<slices;i++)
+				thread(i).wait();
+		}
+		std::cout << "info string Hash cleared with " << threadCount() << " threads in " << timer.elapsed() << " ms" << std::endl;
+	}
+	void mapTT(const std::string &path){
+		uint64_t MB = std::max<uint64_t>(1, TT.size * sizeof(TTBucket) / (1024 * 1024));
+		bool warm;
+		if (TT.mapFile(path, MB, network.checksum(), warm))
+			std::cout << "info string Hash mapped to " << path << " (" << TT.size * sizeof(TTBucket) / (1024 * 1024) << " MB, " << (warm ? "reused" : "new") << ")" << std::endl;
+		else
+			std::cout << "info string Failed to map hash file " << path << std::endl;
+	}
+	void saveTT(const std::string &path){
+		if (TT.save(path, network.checksum()))
+			std::cout << "info string Hash saved to " << path << std::endl;
+		else
+			std::cout << "info string Failed to save hash to " << path << std::endl;
 	}
 	void reset(){
 		mainInfo->reset();
-		for (Search::ThreadInfo &w : workerInfo)
-			w.reset();
-		TT.clear();
+		for (std::unique_ptr<Search::ThreadInfo> &w : workerInfo)
+			w->reset();
+		// A file backed table is meant to outlive games and processes
+		// Otherwise the old game's entries are aged out rather than cleared, so this is O(1) whatever the Hash size
+		if (!TT.fileBacked())
+			TT.newGame();
 	}
 
 	uint64_t nodeCount(){
 		uint64_t nodes = 0;
-		for (Search::ThreadInfo &t : workerInfo){
-			nodes += t.nodes;
+		for (std::unique_ptr<Search::ThreadInfo> &t : workerInfo){
+			nodes += t->publishedNodes.load(std::memory_order_relaxed);
 		}
-		return nodes + mainInfo->nodes;
+		return nodes + mainInfo->publishedNodes.load(std::memory_order_relaxed);
 	}
 };
\ No newline at end of file
@@ -1 +1,62 @@
-#pragma once
\ No newline at end of file
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// A thread that lives as long as the searcher and sleeps on a condition variable between searches
+// So a go doesn't pay for creating it, and it keeps its stack, caches and CPU from the last one
+struct SearchThread {
+	std::mutex mutex;
+	std::condition_variable cv;
+	std::function<void()> job;
+	bool searching = true;
+	bool exit = false;
+	std::thread thread;
+
+	SearchThread() : thread(&SearchThread::idleLoop, this) {
+		wait();
+	}
+	~SearchThread(){
+		wait();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			exit = true;
+			searching = true;
+		}
+		cv.notify_one();
+		thread.join();
+	}
+	SearchThread(const SearchThread&) = delete;
+	SearchThread &operator=(const SearchThread&) = delete;
+
+	// Hands the thread a job, waiting for the previous one first
+	void run(std::function<void()> f){
+		wait();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job = std::move(f);
+			searching = true;
+		}
+		cv.notify_all();
+	}
+	// Blocks until the thread is parked again
+	void wait(){
+		std::unique_lock<std::mutex> lock(mutex);
+		cv.wait(lock, [&]{ return !searching; });
+	}
+	void idleLoop(){
+		while (true){
+			std::unique_lock<std::mutex> lock(mutex);
+			searching = false;
+			// The UCI thread and the main search thread can both be waiting on a helper
+			cv.notify_all();
+			cv.wait(lock, [&]{ return searching; });
+			if (exit)
+				return;
+			lock.unlock();
+			job();
+		}
+	}
+};
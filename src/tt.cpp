@@ -0,0 +1,154 @@
+#include "tt.h"
+
+#include <filesystem>
+#include <fstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+	#include <fcntl.h>
+	#include <sys/file.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+	#define TT_CAN_MAP
+#elif defined(_WIN32)
+	#include <process.h>
+#endif
+
+// Temp file next to path, unique per process so two writing the same path don't share one
+static std::string tempPath(const std::string &path){
+	#if defined(_WIN32)
+		return path + ".tmp" + std::to_string(_getpid());
+	#else
+		return path + ".tmp" + std::to_string(getpid());
+	#endif
+}
+
+void TTable::release(){
+	#if defined(TT_CAN_MAP)
+		if (mapping != nullptr){
+			munmap(mapping, mappingBytes);
+			mapping = nullptr;
+			mappingBytes = 0;
+			table = nullptr;
+			return;
+		}
+	#endif
+	freeTable(table);
+	table = nullptr;
+}
+
+#if defined(TT_CAN_MAP)
+// An empty table of the given size, written next to path and renamed over it
+// Processes that still map the old file keep their copy, truncating it in place would SIGBUS them
+static bool replaceFile(const std::string &path, uint64_t buckets, uint64_t networkHash){
+	const std::string tmp = tempPath(path);
+	int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return false;
+	// Sparse, so the buckets read back as zeroes without being written
+	const TTFileHeader header(buckets, networkHash, 0);
+	const bool ok = ftruncate(fd, TT_FILE_HEADER_SIZE + buckets * sizeof(TTBucket)) == 0
+		&& pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+	close(fd);
+	if (!ok || rename(tmp.c_str(), path.c_str()) != 0){
+		unlink(tmp.c_str());
+		return false;
+	}
+	return true;
+}
+#endif
+
+bool TTable::mapFile(const std::string &path, uint64_t MB, uint64_t networkHash, bool &warm){
+	warm = false;
+	#if defined(TT_CAN_MAP)
+		const uint64_t wantedBuckets = std::max<uint64_t>(1, MB * 1024 * 1024 / sizeof(TTBucket));
+		// Whoever holds the lock checks the file and replaces it if needed, so two processes starting together agree on one table
+		// If the file got replaced while we waited for the lock our fd is the old one, so go again
+		for (int attempt=0;attempt<8;attempt++){
+			int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+			if (fd < 0)
+				return false;
+			if (flock(fd, LOCK_EX) != 0){
+				close(fd);
+				return false;
+			}
+			struct stat st, current;
+			if (fstat(fd, &st) != 0 || stat(path.c_str(), &current) != 0){
+				close(fd);
+				return false;
+			}
+			if (st.st_ino != current.st_ino || st.st_dev != current.st_dev){
+				close(fd);
+				continue;
+			}
+
+			TTFileHeader header{};
+			bool compatible = static_cast<size_t>(st.st_size) >= TT_FILE_HEADER_SIZE
+				&& pread(fd, &header, sizeof(header), 0) == sizeof(header) && header.compatible(networkHash)
+				&& static_cast<size_t>(st.st_size) == TT_FILE_HEADER_SIZE + header.buckets * sizeof(TTBucket);
+			if (!compatible){
+				// Replacing it under the lock makes anyone waiting on the old file retry and find the new one
+				const bool replaced = replaceFile(path, wantedBuckets, networkHash);
+				close(fd);
+				if (!replaced)
+					return false;
+				continue;
+			}
+
+			const size_t bytes = TT_FILE_HEADER_SIZE + header.buckets * sizeof(TTBucket);
+			void *mem = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			// Closing drops the lock too
+			close(fd);
+			if (mem == MAP_FAILED)
+				return false;
+
+			release();
+			mapping = mem;
+			mappingBytes = bytes;
+			mappedPath = path;
+			table = reinterpret_cast<TTBucket*>(static_cast<char*>(mem) + TT_FILE_HEADER_SIZE);
+			size = header.buckets;
+			hugePages = false;
+			// Ageing stays per process from here on, the header keeps what the file was made or saved with
+			generation = header.generation;
+			gameAge = TT_GEN_MASK;
+			// Anything found on a retry was just made, by us or whoever else replaced the file
+			warm = attempt == 0;
+			return true;
+		}
+		return false;
+	#else
+		return false;
+	#endif
+}
+
+bool TTable::save(const std::string &path, uint64_t networkHash){
+	#if defined(TT_CAN_MAP)
+		// Already backed by this file, just make sure it hit the disk
+		std::error_code ec;
+		if (mapping != nullptr && std::filesystem::equivalent(path, mappedPath, ec))
+			return msync(mapping, mappingBytes, MS_SYNC) == 0;
+	#endif
+	// Written next to it and renamed over, another process could have path mapped
+	const std::string tmp = tempPath(path);
+	bool written;
+	{
+		std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+		if (!out)
+			return false;
+		std::array<char, TT_FILE_HEADER_SIZE> headerPage{};
+		TTFileHeader header(size, networkHash, generation);
+		std::memcpy(headerPage.data(), &header, sizeof(header));
+		out.write(headerPage.data(), headerPage.size());
+		out.write(reinterpret_cast<const char*>(table), size * sizeof(TTBucket));
+		written = static_cast<bool>(out.flush());
+	}
+	std::error_code fsError;
+	if (written)
+		std::filesystem::rename(tmp, path, fsError);
+	if (!written || fsError){
+		std::filesystem::remove(tmp, fsError);
+		return false;
+	}
+	return true;
+}
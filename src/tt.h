@@ -1,66 +1,378 @@
 #pragma once
 
 #include "external/chess.hpp"
-#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string>
+
+#if defined(__linux__)
+	#include <sys/mman.h>
+#elif defined(_WIN32)
+	#include <malloc.h>
+#endif
 
 using namespace chess;
 
 enum TTFlag {
+	NONE = 0,
 	EXACT = 1,
 	BETA_CUT = 2,
 	FAIL_LOW = 3
 };
 
+// Lower 2 bits of genBound are the flag, the upper 6 are the generation
+constexpr uint8_t TT_FLAG_MASK = 0b11;
+constexpr uint8_t TT_GEN_DELTA = 1 << 2;
+constexpr int TT_GEN_CYCLE = 255 + TT_GEN_DELTA;
+constexpr uint8_t TT_GEN_MASK = 0xFF & ~TT_FLAG_MASK;
+
+constexpr int TT_BUCKET_SIZE = 6;
+
+// 10 bytes, 6 of them fit in a cache line
 struct TTEntry {
-	uint64_t zobrist;
-	chess::Move move;
-	int score;
-	uint8_t flag;
+	uint16_t key16;
+	uint16_t move;
+	int16_t score;
+	int16_t staticEval;
 	uint8_t depth;
-	TTEntry(){
-		this->zobrist = 0;
-		this->move = chess::Move();
-		this->score = 0;
-		this->flag = 0;
-		this->depth = 0;
-	}
-	TTEntry(uint64_t key, chess::Move best, int score, uint8_t flag, uint8_t depth){
-		this->zobrist = key;
-		this->move = best;
-		this->score = score;
-		this->flag = flag;
-		this->depth = depth;
+	uint8_t genBound;
+
+	chess::Move getMove() const {
+		return chess::Move(move);
+	}
+	uint8_t flag() const {
+		return genBound & TT_FLAG_MASK;
+	}
+	// How many searches ago this entry was written, in steps of TT_GEN_DELTA
+	uint8_t relativeAge(uint8_t generation) const {
+		return (TT_GEN_CYCLE + generation - genBound) & TT_GEN_MASK;
+	}
+	// Same in whole searches
+	int generationsAgo(uint8_t generation) const {
+		return relativeAge(generation) / TT_GEN_DELTA;
+	}
+	// Everything except the key in a single word
+	uint64_t data() const {
+		return static_cast<uint64_t>(move)
+			| static_cast<uint64_t>(static_cast<uint16_t>(score)) << 16
+			| static_cast<uint64_t>(static_cast<uint16_t>(staticEval)) << 32
+			| static_cast<uint64_t>(depth) << 48
+			| static_cast<uint64_t>(genBound) << 56;
+	}
+	static TTEntry unpack(uint16_t key16, uint64_t data){
+		TTEntry e;
+		e.key16 = key16;
+		e.move = static_cast<uint16_t>(data);
+		e.score = static_cast<int16_t>(data >> 16);
+		e.staticEval = static_cast<int16_t>(data >> 32);
+		e.depth = static_cast<uint8_t>(data >> 48);
+		e.genBound = static_cast<uint8_t>(data >> 56);
+		return e;
+	}
+};
+static_assert(sizeof(TTEntry) == 10);
+
+// The key is stored xored with the data word, so a key and data written by
+// two different threads will almost never verify on probe
+inline uint16_t foldData(uint64_t data){
+	return static_cast<uint16_t>(data ^ (data >> 16) ^ (data >> 32) ^ (data >> 48));
+}
+
+// Data and keys are kept apart so each data word is aligned and can be
+// read or written with a single relaxed atomic, keeping probes wait free
+struct alignas(64) TTBucket {
+	std::atomic<uint64_t> data[TT_BUCKET_SIZE];
+	std::atomic<uint16_t> keys[TT_BUCKET_SIZE];
+	char padding[64 - (sizeof(uint64_t) + sizeof(uint16_t)) * TT_BUCKET_SIZE];
+
+	TTEntry load(int i) const {
+		const uint64_t d = data[i].load(std::memory_order_relaxed);
+		const uint16_t k = keys[i].load(std::memory_order_relaxed) ^ foldData(d);
+		return TTEntry::unpack(k, d);
+	}
+	void save(int i, const TTEntry &e){
+		const uint64_t d = e.data();
+		data[i].store(d, std::memory_order_relaxed);
+		keys[i].store(e.key16 ^ foldData(d), std::memory_order_relaxed);
+	}
+};
+static_assert(sizeof(TTBucket) == 64);
+static_assert(std::atomic<uint64_t>::is_always_lock_free);
+
+constexpr size_t TT_HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+// 2 MB aligned so the kernel can back the table with transparent huge pages
+// Falls back to cache line alignment if that fails
+inline TTBucket *allocTable(size_t bytes, bool &hugePages){
+	hugePages = false;
+	#if defined(_WIN32)
+		return static_cast<TTBucket*>(_aligned_malloc(bytes, alignof(TTBucket)));
+	#else
+		const size_t rounded = (bytes + TT_HUGE_PAGE_SIZE - 1) / TT_HUGE_PAGE_SIZE * TT_HUGE_PAGE_SIZE;
+		void *mem = std::aligned_alloc(TT_HUGE_PAGE_SIZE, rounded);
+		if (mem == nullptr)
+			return static_cast<TTBucket*>(std::aligned_alloc(alignof(TTBucket), bytes));
+		#if defined(__linux__) && defined(MADV_HUGEPAGE)
+			hugePages = madvise(mem, rounded, MADV_HUGEPAGE) == 0;
+		#endif
+		return static_cast<TTBucket*>(mem);
+	#endif
+}
+
+inline void freeTable(TTBucket *mem){
+	#if defined(_WIN32)
+		_aligned_free(mem);
+	#else
+		std::free(mem);
+	#endif
+}
+
+// Persistent/shared tables are laid out as this header padded to a page, then the buckets
+constexpr char TT_FILE_MAGIC[8] = {'T', 'A', 'R', 'N', 'H', 'A', 'S', 'H'};
+constexpr uint32_t TT_FILE_VERSION = 1;
+constexpr size_t TT_FILE_HEADER_SIZE = 4096;
+
+struct TTFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t bucketBytes;
+	uint32_t bucketEntries;
+	uint8_t generation;
+	uint64_t buckets;
+	uint64_t networkHash;
+
+	TTFileHeader() = default;
+	TTFileHeader(uint64_t buckets, uint64_t networkHash, uint8_t generation) : version(TT_FILE_VERSION), bucketBytes(sizeof(TTBucket)),
+		bucketEntries(TT_BUCKET_SIZE), generation(generation), buckets(buckets), networkHash(networkHash) {
+		std::memcpy(magic, TT_FILE_MAGIC, sizeof(magic));
+	}
+	bool compatible(uint64_t netHash) const {
+		return std::memcmp(magic, TT_FILE_MAGIC, sizeof(magic)) == 0 && version == TT_FILE_VERSION
+			&& bucketBytes == sizeof(TTBucket) && bucketEntries == TT_BUCKET_SIZE && buckets > 0 && networkHash == netHash;
+	}
+};
+static_assert(sizeof(TTFileHeader) <= TT_FILE_HEADER_SIZE);
+
+// Lossy cache of raw network evals, shared by all threads
+// An entry is the upper 48 bits of the key and the eval packed into one word, so it can't tear
+struct EvalCache {
+	std::unique_ptr<std::atomic<uint64_t>[]> entries;
+	uint64_t size;
+
+	EvalCache(uint64_t sizeMB = 8){
+		resize(sizeMB);
+	}
+	void resize(uint64_t MB){
+		size = std::max<uint64_t>(1, MB * 1024 * 1024 / sizeof(uint64_t));
+		entries = std::make_unique<std::atomic<uint64_t>[]>(size);
+		clear();
+	}
+	void clear(){
+		std::memset(static_cast<void*>(entries.get()), 0, size * sizeof(uint64_t));
+	}
+	uint64_t index(uint64_t key){
+		return static_cast<uint64_t>((static_cast<unsigned __int128>(key) * static_cast<unsigned __int128>(size)) >> 64);
+	}
+	void prefetch(uint64_t key){
+		#if defined(__GNUC__) || defined(__clang__)
+			__builtin_prefetch(&entries[index(key)]);
+		#endif
+	}
+	bool probe(uint64_t key, int &eval){
+		const uint64_t e = entries[index(key)].load(std::memory_order_relaxed);
+		if (((e ^ key) >> 16) != 0 || e == 0)
+			return false;
+		eval = static_cast<int16_t>(e);
+		return true;
+	}
+	void store(uint64_t key, int eval){
+		const uint16_t packed = static_cast<uint16_t>(static_cast<int16_t>(std::clamp(eval, -32767, 32767)));
+		entries[index(key)].store((key & ~0xFFFFULL) | packed, std::memory_order_relaxed);
+	}
+};
+
+// Positions some thread is searching right now, for ABDADA (the Kerrigan simplified version)
+// TT entries have no room for a thread count, so the marks get their own small table
+// A collision only means a move gets deferred when it didn't have to be or the other way around
+struct BusyTable {
+	static constexpr uint64_t SIZE = 1 << 15;
+	std::unique_ptr<std::atomic<uint64_t>[]> keys;
+
+	BusyTable() : keys(std::make_unique<std::atomic<uint64_t>[]>(SIZE)) {
+		clear();
+	}
+	void clear(){
+		std::memset(static_cast<void*>(keys.get()), 0, SIZE * sizeof(uint64_t));
+	}
+	bool busy(uint64_t key) const {
+		return keys[key & (SIZE - 1)].load(std::memory_order_relaxed) == key;
+	}
+	void mark(uint64_t key){
+		keys[key & (SIZE - 1)].store(key, std::memory_order_relaxed);
+	}
+	// Leaves the slot alone if another position took it since
+	void unmark(uint64_t key){
+		keys[key & (SIZE - 1)].compare_exchange_strong(key, 0, std::memory_order_relaxed);
 	}
 };
 
 struct TTable {
 private:
-	std::vector<TTEntry> table;
+	TTBucket *table;
+	uint8_t generation;
+	// relativeAge of the oldest entry that's from this game, anything older is from before ucinewgame and never hits
+	// Stops at TT_GEN_MASK, after that many searches nothing is old enough to hide
+	uint8_t gameAge;
+	// Non null when the table lives in a mmaped file instead of the heap
+	void *mapping;
+	size_t mappingBytes;
+	std::string mappedPath;
+
+	void release();
 public:
 	uint64_t size;
+	bool hugePages;
+	// Lives here so everything sharing a table shares the evals too
+	EvalCache evals;
+	BusyTable busy;
 
 	TTable(uint64_t sizeMB = 16){
-
+		table = nullptr;
+		size = 0;
+		mapping = nullptr;
+		mappingBytes = 0;
+		generation = 0;
 		resize(sizeMB);
+		clear();
+	}
+	~TTable(){
+		release();
+	}
+	TTable(const TTable&) = delete;
+	TTable &operator=(const TTable&) = delete;
+
+	// Zeroes slice idx of count, so each search thread can clear its own and be the first to touch those pages
+	void clearSlice(int idx, int count){
+		const uint64_t chunk = (size + count - 1) / count;
+		const uint64_t start = std::min(size, chunk * idx);
+		const uint64_t end = std::min(size, start + chunk);
+		std::memset(static_cast<void*>(table + start), 0, (end - start) * sizeof(TTBucket));
+	}
+	// Everything clear() does besides the buckets
+	void clearCaches(){
+		evals.clear();
+		busy.clear();
+		generation = 0;
+		gameAge = TT_GEN_MASK;
 	}
 	void clear(){
-		std::fill(table.begin(), table.end(), TTEntry{});
+		clearSlice(0, 1);
+		clearCaches();
 	}
-	void resize(uint64_t MB){
-		size = MB * 1024 * 1024 / sizeof(TTEntry);
-		if (size == 0)
-			size++;
-		table.resize(size);
+	// Leaves the table uninitialized, clear() must be called afterwards
+	// If MB can't be had, goes back to the old size (or 1 MB) and returns false
+	bool resize(uint64_t MB){
+		const uint64_t oldSize = size;
+		release();
+		for (uint64_t buckets : {MB * 1024 * 1024 / sizeof(TTBucket), oldSize, 1024 * 1024 / sizeof(TTBucket)}){
+			size = std::max<uint64_t>(1, buckets);
+			table = allocTable(size * sizeof(TTBucket), hugePages);
+			if (table != nullptr)
+				return size == std::max<uint64_t>(1, MB * 1024 * 1024 / sizeof(TTBucket));
+		}
+		throw std::bad_alloc();
+	}
+	// Called once per go, older entries become preferred for replacement
+	// Each process sharing a mapped table ages it by its own count, the header's is only written by savehash
+	void newSearch(){
+		generation += TT_GEN_DELTA;
+		if (gameAge < TT_GEN_MASK)
+			gameAge += TT_GEN_DELTA;
+	}
+	// ucinewgame without touching the table, the old game's entries just stop hitting and get replaced first
+	void newGame(){
+		generation += TT_GEN_DELTA;
+		gameAge = 0;
+	}
+
+	bool fileBacked(){
+		return mapping != nullptr;
 	}
-	uint64_t index(uint64_t key) { 
-		return key % size;
+	const std::string &mappedFile(){
+		return mappedPath;
+	}
+	// Maps the table onto a file, which is shared with any other process mapping it
+	// A compatible file is used as is, otherwise it is recreated with MB megabytes
+	bool mapFile(const std::string &path, uint64_t MB, uint64_t networkHash, bool &warm);
+	// Writes the table in the same format mapFile reads
+	bool save(const std::string &path, uint64_t networkHash);
+	// Multiply shift instead of modulo, the low 16 bits are left for the key
+	uint64_t index(uint64_t key) {
+		return static_cast<uint64_t>((static_cast<unsigned __int128>(key) * static_cast<unsigned __int128>(size)) >> 64);
 	}
 
-	void setEntry(TTEntry entry){
-		table[index(entry.zobrist)] = entry;
+	// Pull the bucket into cache early, e.g. before making the move that leads to it
+	void prefetch(uint64_t key){
+		#if defined(__GNUC__) || defined(__clang__)
+			__builtin_prefetch(&table[index(key)]);
+		#endif
+		evals.prefetch(key);
 	}
-	TTEntry *getEntry(uint64_t key){
-		return &table[index(key)];
+
+	bool probe(uint64_t key, TTEntry &entry){
+		const uint16_t key16 = static_cast<uint16_t>(key);
+		const TTBucket &bucket = table[index(key)];
+		for (int i=0;i<TT_BUCKET_SIZE;i++){
+			const TTEntry e = bucket.load(i);
+			if (e.key16 == key16 && e.flag() != TTFlag::NONE && e.relativeAge(generation) <= gameAge){
+				entry = e;
+				return true;
+			}
+		}
+		entry = TTEntry{};
+		return false;
 	}
 
-};
\ No newline at end of file
+	void store(uint64_t key, chess::Move move, int score, int staticEval, uint8_t flag, int depth){
+		const uint16_t key16 = static_cast<uint16_t>(key);
+		TTBucket &bucket = table[index(key)];
+
+		// Same position or an empty slot (or one from before ucinewgame), else the shallowest and oldest entry
+		// Each search an entry has sat through counts as 8 plies of depth (as in Stockfish)
+		int replaceIdx = 0;
+		TTEntry replace = bucket.load(0);
+		for (int i=0;i<TT_BUCKET_SIZE;i++){
+			const TTEntry e = bucket.load(i);
+			if (e.key16 == key16 || e.flag() == TTFlag::NONE || e.relativeAge(generation) > gameAge){
+				replaceIdx = i;
+				replace = e;
+				break;
+			}
+			if (e.depth - 8 * e.generationsAgo(generation) < replace.depth - 8 * replace.generationsAgo(generation)){
+				replaceIdx = i;
+				replace = e;
+			}
+		}
+
+		// Nothing carries over from an entry of an earlier game, not even its move
+		if (replace.relativeAge(generation) > gameAge)
+			replace = TTEntry{};
+
+		// Keep the old move if we dont have a new one for this position
+		if (move != Move::NO_MOVE || replace.key16 != key16)
+			replace.move = move.move();
+
+		if (flag == TTFlag::EXACT || replace.key16 != key16 || depth + 4 > replace.depth || replace.relativeAge(generation)){
+			replace.key16 = key16;
+			replace.score = static_cast<int16_t>(std::clamp(score, -32767, 32767));
+			replace.staticEval = static_cast<int16_t>(std::clamp(staticEval, -32767, 32767));
+			replace.depth = static_cast<uint8_t>(std::clamp(depth, 0, 255));
+			replace.genBound = generation | flag;
+		}
+		bucket.save(replaceIdx, replace);
+	}
+};
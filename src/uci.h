@@ -7,23 +7,55 @@
 
 #define INPUT_SIZE 8192
 
+// Commands are looked up by their exact first word, so two can never be mistaken for each other
 enum InputCommands {
+    UNKNOWN,
     // UCI
-    GO          = 11,
-    UCI         = 127,
-    STOP        = 28,
-    QUIT        = 29,
-    ISREADY     = 113,
-    POSITION    = 17,
-    SETOPTION   = 96,
-    UCINEWGAME  = 6,
+    GO,
+    UCI,
+    STOP,
+    QUIT,
+    ISREADY,
+    POSITION,
+    SETOPTION,
+    UCINEWGAME,
     // Non-UCI
-    BENCH       = 99,
-    EVAL        = 26,
-    PRINT       = 112,
-    DATAGEN     = 124
+    BENCH,
+    EVAL,
+    PRINT,
+    DATAGEN,
+    SAVEHASH,
+    PERFT,
+    QUANTCHECK,
+    EXPORTNET,
+    NETBENCH,
+    SMPBENCH,
+    TTSTRESS,
+    EVALBATCH
 };
 
+struct CommandName {
+    const char *name;
+    InputCommands command;
+};
+
+constexpr CommandName COMMANDS[] = {
+    {"go", GO}, {"uci", UCI}, {"stop", STOP}, {"quit", QUIT}, {"isready", ISREADY}, {"position", POSITION},
+    {"setoption", SETOPTION}, {"ucinewgame", UCINEWGAME}, {"bench", BENCH}, {"eval", EVAL}, {"print", PRINT},
+    {"datagen", DATAGEN}, {"savehash", SAVEHASH}, {"perft", PERFT}, {"quantcheck", QUANTCHECK},
+    {"exportnet", EXPORTNET}, {"netbench", NETBENCH}, {"smpbench", SMPBENCH}, {"ttstress", TTSTRESS},
+    {"evalbatch", EVALBATCH}
+};
+
+// Command named by the first word of str, UNKNOWN for anything else
+InputCommands ParseCommand(const char *str) {
+    const size_t len = strcspn(str, " ");
+    for (const CommandName &c : COMMANDS)
+        if (strlen(c.name) == len && strncmp(str, c.name, len) == 0)
+            return c.command;
+    return UNKNOWN;
+}
+
 bool GetInput(char *str) {
     memset(str, 0, INPUT_SIZE);
     if (fgets(str, INPUT_SIZE, stdin) == NULL)
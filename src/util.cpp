@@ -11,15 +11,22 @@
 
 Bitboard BetweenBB[64][64] = {};
 Bitboard Rays[64][8] = {};
-// Accumulator wrapper
-void MakeMove(Board &board, Accumulator &acc, Move &move){
+// Features a move adds and removes, called before the move is made
+void DirtyFeatures(Board &board, Move &move, DirtyPieces &dirty){
 	PieceType to = board.at<PieceType>(move.to());
 	PieceType from = board.at<PieceType>(move.from());
 	Color stm = board.sideToMove();
-	board.makeMove(move);
-	if (move.typeOf() == Move::ENPASSANT || move.typeOf() == Move::PROMOTION){
-		// For now just recalculate on special moves like these
-		acc.refresh(board);
+	if (move.typeOf() == Move::ENPASSANT){
+		// The captured pawn is behind the target square
+		dirty.add(stm, PieceType::PAWN, move.to());
+		dirty.sub(stm, PieceType::PAWN, move.from());
+		dirty.sub(~stm, PieceType::PAWN, move.to().ep_square());
+	}
+	else if (move.typeOf() == Move::PROMOTION){
+		dirty.add(stm, move.promotionType(), move.to());
+		dirty.sub(stm, PieceType::PAWN, move.from());
+		if (to != PieceType::NONE)
+			dirty.sub(~stm, to, move.to());
 	}
 	else if (move.typeOf() == Move::CASTLING){
 		Square king = move.from();
@@ -28,42 +35,68 @@ void MakeMove(Board &board, Accumulator &acc, Move &move){
 		// There are basically just 2 quiet moves now
 		// Move king and move rook
 		// Since moves are encoded as king takes rook, its very easy
-		acc.quiet(stm, kingTo, PieceType::KING, move.from(), PieceType::KING);
-		acc.quiet(stm, rookTo, PieceType::ROOK, move.to(), PieceType::ROOK);
+		dirty.add(stm, PieceType::KING, kingTo);
+		dirty.add(stm, PieceType::ROOK, rookTo);
+		dirty.sub(stm, PieceType::KING, move.from());
+		dirty.sub(stm, PieceType::ROOK, move.to());
 	}
 	else if (to != PieceType::NONE){
-		acc.capture(stm, move.to(), from, move.from(), from, move.to(), to);
+		dirty.add(stm, from, move.to());
+		dirty.sub(stm, from, move.from());
+		dirty.sub(~stm, to, move.to());
+	}
+	else {
+		dirty.add(stm, from, move.to());
+		dirty.sub(stm, from, move.from());
 	}
-	else
-		acc.quiet(stm, move.to(), from, move.from(), from);
+}
 
+// Accumulator wrapper
+// Only records the changed features, the accumulator itself is updated lazily on evaluation
+void MakeMove(Board &board, AccumulatorStack &accs, Move &move){
+	DirtyFeatures(board, move, accs.push());
+	board.makeMove(move);
 }
 
-void UnmakeMove(Board &board, Accumulator &acc, Move &move){
+void UnmakeMove(Board &board, AccumulatorStack &accs, Move &move){
 	board.unmakeMove(move);
+	accs.pop();
+}
 
-	PieceType to = board.at<PieceType>(move.to());
-	PieceType from = board.at<PieceType>(move.from());
-	Color stm = board.sideToMove();
+void MakeMove(Board &board, AccumulatorStack &accs, SmallAccumulatorStack &small, Move &move){
+	DirtyPieces &dirty = accs.push();
+	DirtyFeatures(board, move, dirty);
+	small.push() = dirty;
+	board.makeMove(move);
+}
 
-	if (move.typeOf() == Move::ENPASSANT || move.typeOf() == Move::PROMOTION){
-		// For now just recalculate on special moves like these
-		acc.refresh(board);
-	}
-	else if (move.typeOf() == Move::CASTLING){
-		Square king = move.from();
-		Square kingTo = (king > move.to()) ? king - 2 : king + 2;
-		Square rookTo = (king > move.to()) ? kingTo + 1 : kingTo - 1;
-		// There are basically just 2 quiet moves now
-		acc.quiet(stm, move.from(), PieceType::KING, kingTo, PieceType::KING);
-		acc.quiet(stm, move.to(), PieceType::ROOK, rookTo, PieceType::ROOK);
-	}
-	else if (to != PieceType::NONE){
-		acc.uncapture(stm, move.from(), from, move.to(), to, move.to(), from);
+void UnmakeMove(Board &board, AccumulatorStack &accs, SmallAccumulatorStack &small, Move &move){
+	board.unmakeMove(move);
+	accs.pop();
+	small.pop();
+}
+
+// Perft through MakeMove/UnmakeMove
+// With check set, every node's lazily updated accumulator is also compared against a full refresh
+uint64_t perft(Board &board, AccumulatorStack &accs, int depth, bool check, uint64_t &mismatches){
+	if (check){
+		Accumulator fresh;
+		fresh.refresh(network, board);
+		Accumulator &lazy = accs.current();
+		if (fresh.white != lazy.white || fresh.black != lazy.black)
+			mismatches++;
 	}
-	else {
-		acc.quiet(stm, move.from(), from, move.to(), from);
+	if (depth == 0)
+		return 1;
+	Movelist moves;
+	movegen::legalmoves(moves, board);
+	uint64_t nodes = 0;
+	for (Move &move : moves){
+		MakeMove(board, accs, move);
+		nodes += perft(board, accs, depth - 1, check, mismatches);
+		UnmakeMove(board, accs, move);
 	}
+	return nodes;
 }
 
 // Utility attackers
@@ -208,6 +241,52 @@ void pinnersBlockers(Board &board, Color stm, StateInfo *sti){
 
 	}	
 }
+void legalityInfo(Board &board, StateInfo *sti){
+	Color stm = board.sideToMove();
+	pinnersBlockers(board, stm, sti);
+	sti->checkers = attackersTo(board, board.kingSq(stm), board.occ()) & board.us(~stm);
+}
+
+bool isLegal(Board &board, Move move, const StateInfo &sti){
+	Color stm = board.sideToMove();
+	Square ksq = board.kingSq(stm);
+	Square from = move.from();
+	Square to = move.to();
+	Bitboard them = board.us(~stm);
+	if (move.typeOf() == Move::CASTLING){
+		if (sti.checkers)
+			return false;
+		// King takes rook, so the rook comes off first. In chess960 that can be what was shielding the king
+		Square kingTo = Square::castling_king_square(to > from, stm);
+		Bitboard occ = board.occ() ^ Bitboard::fromSquare(from) ^ Bitboard::fromSquare(to);
+		Bitboard path = BetweenBB[from.index()][kingTo.index()] | Bitboard::fromSquare(kingTo);
+		while (path)
+			if (attackersTo(board, path.pop(), occ) & them)
+				return false;
+		return true;
+	}
+	if (move.typeOf() == Move::ENPASSANT){
+		// Two pawns leave the rank at once, easiest to just look at the king afterwards
+		Bitboard occ = (board.occ() ^ Bitboard::fromSquare(from) ^ Bitboard::fromSquare(to.ep_square())) | Bitboard::fromSquare(to);
+		return !(attackersTo(board, ksq, occ) & them & occ);
+	}
+	if (from == ksq)
+		return !(attackersTo(board, to, board.occ() ^ Bitboard::fromSquare(from)) & them);
+	if (sti.checkers){
+		// Double check, only the king can move
+		if (sti.checkers.count() > 1)
+			return false;
+		// Otherwise capture the checker or block it
+		Square checker = sti.checkers.lsb();
+		if (!((BetweenBB[ksq.index()][checker.index()] | sti.checkers) & Bitboard::fromSquare(to)))
+			return false;
+	}
+	if (!(sti.kingBlockers[(int)stm] & board.us(stm) & Bitboard::fromSquare(from)))
+		return true;
+	// Pinned, has to stay between the king and the pinner or take it
+	return (BetweenBB[ksq.index()][to.index()] & Bitboard::fromSquare(from)) || (BetweenBB[ksq.index()][from.index()] & Bitboard::fromSquare(to));
+}
+
 // Stockfish and Sirius
 bool SEE(Board &board, Move &move, int margin){
 	Square from = move.from();
@@ -24,9 +24,11 @@ enum DirIndex {
 struct StateInfo {
 	Bitboard pinners[2];
 	Bitboard kingBlockers[2];
+	Bitboard checkers;
 	StateInfo(){
 		pinners[0] = Bitboard(0); pinners[1] = Bitboard(0);
 		kingBlockers[0] = Bitboard(0); kingBlockers[1] = Bitboard(0);
+		checkers = Bitboard(0);
 	}
 };
 // Values taken from SF
@@ -52,14 +54,24 @@ inline void deepFill(std::array<T, N>& arr, const U& value) {
 
 
 // Accumulator wrapper
-void MakeMove(Board &board, Accumulator &acc, Move &move);
-void UnmakeMove(Board &board, Accumulator &acc, Move &move);
+void DirtyFeatures(Board &board, Move &move, DirtyPieces &dirty);
+void MakeMove(Board &board, AccumulatorStack &accs, Move &move);
+void UnmakeMove(Board &board, AccumulatorStack &accs, Move &move);
+// Keeps the small net's accumulators in step, it is lazy so this costs next to nothing when it isn't used
+void MakeMove(Board &board, AccumulatorStack &accs, SmallAccumulatorStack &small, Move &move);
+void UnmakeMove(Board &board, AccumulatorStack &accs, SmallAccumulatorStack &small, Move &move);
+// With check, counts nodes whose accumulator differs from a full refresh in mismatches
+uint64_t perft(Board &board, AccumulatorStack &accs, int depth, bool check, uint64_t &mismatches);
 // SEE stuff
 void initLookups();
 int oppDir(int dir);
 Bitboard attackersTo(Board &board, Square s, Bitboard occ);
-void pinnersBlockers(Board &board, Color c, StateInfo sti);
+void pinnersBlockers(Board &board, Color c, StateInfo *sti);
 bool SEE(Board &board, Move &move, int margin);
+// Legality of pseudo legal moves
+// legalityInfo fills in the side to move's pins and checkers once per position, isLegal then only looks at the move
+void legalityInfo(Board &board, StateInfo *sti);
+bool isLegal(Board &board, Move move, const StateInfo &sti);
 
 // Util Move
 static bool moveIsNull(Move m){